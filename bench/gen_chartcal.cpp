@@ -0,0 +1,146 @@
+/*
+
+**********************************************************************
+ Copyright 2009, 2010 by Dan (Dacust), Henrik Jessen, Marco Certelli
+**********************************************************************
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+**********************************************************************
+
+gen_chartcal: writes a synthetic CHARTCAL.DIR to stdout for benchmarking.
+The same options and seed always give the same file.
+
+***************************************************************************
+*/
+
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include <cstdio>
+
+using namespace std;
+
+// Small and portable random generator, so the files are the same everywhere
+class random_source
+{
+private:
+    unsigned long long state;
+public:
+    random_source(unsigned long long seed) : state(seed * 2654435761ULL + 1) {}
+
+    unsigned long long next()
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        return state;
+    }
+    long int between(long int low, long int high)   { return low + (long int) (next() % (high - low + 1)); }
+    double uniform(double low, double high)         { return low + (high - low) * (next() >> 11) / 9007199254740992.0; }
+};
+
+int main ( int argc, char *argv[] )
+{
+    unsigned int sections = 1000, refs = 20, plys = 20, comments = 4;
+    unsigned long long seed = 1;
+
+    int argcount = 1;
+    while (argcount < argc)
+    {
+        string in_switch = argv[argcount];
+        if (argcount < argc-1 && in_switch == "-n")         sections = atoi(argv[++argcount]);
+        else if (argcount < argc-1 && in_switch == "-r")    refs = atoi(argv[++argcount]);
+        else if (argcount < argc-1 && in_switch == "-p")    plys = atoi(argv[++argcount]);
+        else if (argcount < argc-1 && in_switch == "-c")    comments = atoi(argv[++argcount]);
+        else if (argcount < argc-1 && in_switch == "-S")    seed = strtoull(argv[++argcount], 0, 10);
+        else
+        {
+            cout<<"Usage: gen_chartcal [-n sections] [-r refpoints] [-p plypoints] [-c commentlines] [-S seed]"<<endl;
+            return 1;
+        }
+        argcount++;
+    }
+
+    random_source rnd(seed);
+    char cbuf[256];
+
+    cout << "; Synthetic calibration file written by gen_chartcal\r\n";
+    for (unsigned int s = 0; s < sections; s++)
+    {
+        // A chart somewhere in the northern hemisphere, about a degree wide
+        double lat0 = rnd.uniform(25.0, 60.0);
+        double lon0 = rnd.uniform(-170.0, 170.0);
+        double dlat = rnd.uniform(0.2, 1.0);
+        double dlon = rnd.uniform(0.2, 1.5);
+        long int wi = rnd.between(4000, 12000);
+        long int he = rnd.between(4000, 12000);
+
+        snprintf(cbuf, sizeof(cbuf), "[BENCH%05u.tif]\r\nFN=bench%05u.tif\r\n", s, s);
+        cout << cbuf;
+        snprintf(cbuf, sizeof(cbuf), "NA=Synthetic chart %u of the benchmark\r\nNU=%u\r\n", s, 10000 + s);
+        cout << cbuf;
+        snprintf(cbuf, sizeof(cbuf), "WI=%ld\r\nHE=%ld\r\nSC=%ld\r\nGD=WGS84\r\nPR=%ld\r\nDU=%ld\r\n",
+                 wi, he, rnd.between(1, 50) * 5000, rnd.between(0, 3), rnd.between(0, 3));
+        cout << cbuf;
+        snprintf(cbuf, sizeof(cbuf), "SD=MEAN LOWER LOW WATER\r\nDX=%.2f\r\nDY=%.2f\r\nDS=%.6f,%.6f\r\n",
+                 rnd.uniform(0.5, 3.0), rnd.uniform(0.5, 3.0), rnd.uniform(-0.001, 0.001), rnd.uniform(-0.001, 0.001));
+        cout << cbuf;
+        if (s % 3 == 0)
+        {
+            snprintf(cbuf, sizeof(cbuf), "LON0=%.4f\r\n", lon0 + dlon / 2);
+            cout << cbuf;
+        }
+
+        // The comment: plain lines mixed with BSBHDR directives
+        for (unsigned int c = 0; c < comments; c++)
+        {
+            cout << (c == 0 ? "CR=" : " ");
+            switch (c % 4)
+            {
+            case 1:
+                snprintf(cbuf, sizeof(cbuf), "BSBHDR KNP/PI=%.1f,SP=%.1f,SK=0.0,TA=90.0", rnd.uniform(1, 5), rnd.uniform(1, 5));
+                break;
+            case 2:
+                snprintf(cbuf, sizeof(cbuf), "BSBHDR IFM/%ld", rnd.between(3, 7));
+                break;
+            case 3:
+                snprintf(cbuf, sizeof(cbuf), "BSBHDR BSB/ED=%02ld/%02ld/2010", rnd.between(1, 12), rnd.between(1, 28));
+                break;
+            default:
+                snprintf(cbuf, sizeof(cbuf), "Synthetic comment line %u of chart %u", c, s);
+                break;
+            }
+            cout << cbuf << "\r\n";
+        }
+        if (s % 10 == 0)
+        {
+            cout << "; a MapCal comment line\r\n";
+        }
+
+        for (unsigned int r = 1; r <= refs; r++)
+        {
+            snprintf(cbuf, sizeof(cbuf), "C%u=%ld,%ld,%.9f,%.9f\r\n", r, rnd.between(0, wi), rnd.between(0, he),
+                     lat0 + rnd.uniform(0, dlat), lon0 + rnd.uniform(0, dlon));
+            cout << cbuf;
+        }
+        for (unsigned int p = 1; p <= plys; p++)
+        {
+            snprintf(cbuf, sizeof(cbuf), "B%u=%.7f,%.7f\r\n", p, lat0 + rnd.uniform(0, dlat), lon0 + rnd.uniform(0, dlon));
+            cout << cbuf;
+        }
+        cout << "\r\n";
+    }
+    return 0;
+}
@@ -0,0 +1,174 @@
+/*
+
+**********************************************************************
+ Copyright 2009, 2010 by Dan (Dacust), Henrik Jessen, Marco Certelli
+**********************************************************************
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+**********************************************************************
+
+mc2bsbh_bench: times the parse, convert and write phases of the converter
+separately on one CHARTCAL.DIR, and reports sections/s and MB/s for each.
+Every phase is run several times and the best run is reported.
+
+***************************************************************************
+*/
+
+#include "../mc2bsbh.h"
+
+#include <iostream>
+#include <iomanip>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstdio>
+#include <unistd.h>
+
+using namespace std;
+
+static double now()
+{
+    return chrono::duration<double>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Split the text into sections, one buffer each
+static bool read_sections(string_view text, vector<input_buffer> &sections, string &error)
+{
+    sections.clear();
+    section_reader reader(text);
+    sections.emplace_back();
+    while (reader.next(sections.back()))
+    {
+        sections.emplace_back();
+    }
+    sections.pop_back();
+    error = reader.error();
+    return error.empty();
+}
+
+static void report(const char *phase, double seconds, size_t sections, size_t bytes)
+{
+    cout << left << setw(10) << phase << right << fixed
+         << setprecision(4) << setw(10) << seconds << " s"
+         << setprecision(0) << setw(14) << sections / seconds << " sections/s"
+         << setprecision(1) << setw(10) << bytes / seconds / 1e6 << " MB/s" << endl;
+}
+
+int main ( int argc, char *argv[] )
+{
+    string in_filename;
+    unsigned int iterations = 5;
+
+    int argcount = 1;
+    while (argcount < argc)
+    {
+        string in_switch = argv[argcount];
+        if (argcount < argc-1 && in_switch == "-i")   iterations = atoi(argv[++argcount]);
+        else if (in_switch[0] != '-')                 in_filename = in_switch;
+        else
+        {
+            in_filename.clear();
+            break;
+        }
+        argcount++;
+    }
+    if (in_filename.empty() || iterations == 0)
+    {
+        cout<<"Usage: mc2bsbh_bench [-i iterations] CHARTCAL.DIR"<<endl;
+        return 1;
+    }
+
+    mapped_file inFile;
+    if (!inFile.open(in_filename))
+    {
+        cout<<"Could not open file "<<in_filename<<endl;
+        return 1;
+    }
+
+    // Parse: split the file into sections
+    vector<input_buffer> sections;
+    string error;
+    double best_parse = 0;
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+        double start = now();
+        bool ok = read_sections(inFile.contents(), sections, error);
+        double t = now() - start;
+        if (!ok)
+        {
+            cout<<error<<endl;
+            return 1;
+        }
+        if (i == 0 || t < best_parse) best_parse = t;
+    }
+
+    // Convert: build the header of every section. Converting adds lines to
+    // a section, so every run works on freshly parsed sections.
+    vector<string> headers(sections.size());
+    double best_convert = 0;
+    size_t header_bytes = 0;
+    for (unsigned int i = 0; i < iterations; i++)
+    {
+        read_sections(inFile.contents(), sections, error);
+        double start = now();
+        for (size_t s = 0; s < sections.size(); s++)
+            convert_header(sections[s], headers[s]);
+        double t = now() - start;
+        if (i == 0 || t < best_convert) best_convert = t;
+    }
+    for (size_t s = 0; s < headers.size(); s++)
+        header_bytes += headers[s].size();
+
+    // Write: put the headers into a scratch directory
+    char dir_template[] = "/tmp/mc2bsbh_bench.XXXXXX";
+    const char *dir = mkdtemp(dir_template);
+    if (!dir)
+    {
+        cout<<"Could not create a scratch directory"<<endl;
+        return 1;
+    }
+    vector<string> names(sections.size());
+    for (size_t s = 0; s < sections.size(); s++)
+        names[s] = string(dir) + "/" + string(section_name(sections[s])) + ".hdr";
+
+    double best_write = 0;
+    bool write_ok = true;
+    for (unsigned int i = 0; i < iterations && write_ok; i++)
+    {
+        double start = now();
+        for (size_t s = 0; s < sections.size(); s++)
+            write_ok = write_file(names[s], headers[s]) && write_ok;
+        double t = now() - start;
+        if (i == 0 || t < best_write) best_write = t;
+    }
+    for (size_t s = 0; s < names.size(); s++)
+        unlink(names[s].c_str());
+    rmdir(dir);
+    if (!write_ok)
+    {
+        cout<<"Could not write the headers"<<endl;
+        return 1;
+    }
+
+    size_t in_bytes = inFile.contents().size();
+    cout << in_filename << ": " << sections.size() << " sections, " << in_bytes << " bytes in, "
+         << header_bytes << " bytes out, best of " << iterations << endl;
+    report("parse", best_parse, sections.size(), in_bytes);
+    report("convert", best_convert, sections.size(), in_bytes);
+    report("write", best_write, sections.size(), header_bytes);
+    report("total", best_parse + best_convert + best_write, sections.size(), in_bytes);
+    return 0;
+}
@@ -0,0 +1,1921 @@
+/*
+ 
+**********************************************************************
+ Copyright 2009, 2010 by Dan (Dacust), Henrik Jessen, Marco Certelli
+**********************************************************************
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+**********************************************************************
+
+libmc2bsbh: reading MapCal sections and converting them to BSB headers.
+See mc2bsbh.h for the interface and mc2bsbh.cpp for the history.
+
+***************************************************************************
+*/
+
+#include "mc2bsbh.h"
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <charconv>
+#include <algorithm>
+#include <atomic>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+using namespace std;
+
+// We assume that this value will never appear in a valid MapCal file.
+const long int input_buffer::NAN_L = -0x7FFFFFFF;
+const double input_buffer::NAN_D = input_buffer::NAN_L;
+
+// Map the file into memory. Files that can't be mapped are read instead.
+// "-" is stdin, which is mapped too if it is a file.
+bool mapped_file::open(const string &filename)
+{
+    close();
+
+    int fd = filename == "-" ? dup(0) : ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        void *p = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (p != MAP_FAILED)
+        {
+            madvise(p, st.st_size, MADV_SEQUENTIAL);
+            data = (const char *) p;
+            size = st.st_size;
+            mapped = true;
+            ::close(fd);
+            return true;
+        }
+    }
+
+    char chunk[65536];
+    ssize_t n;
+    while ((n = ::read(fd, chunk, sizeof(chunk))) > 0)
+    {
+        copy.append(chunk, n);
+    }
+    ::close(fd);
+
+    data = copy.data();
+    size = copy.size();
+    return n == 0;
+}
+
+// Take the whole contents of a stream instead of a file
+bool mapped_file::read(istream &in)
+{
+    close();
+
+    char chunk[65536];
+    while (in.read(chunk, sizeof(chunk)) || in.gcount() > 0)
+    {
+        copy.append(chunk, in.gcount());
+    }
+
+    data = copy.data();
+    size = copy.size();
+    return !in.bad();
+}
+
+void mapped_file::close()
+{
+    if (mapped) munmap((void *) data, size);
+
+    data = 0;
+    size = 0;
+    mapped = false;
+    copy.clear();
+}
+
+// Hand out memory for text; blocks too small for it are passed over
+char *text_arena::allocate(size_t size)
+{
+    while (current < blocks.size() && used + size > block_sizes[current])
+    {
+        current++;
+        used = 0;
+    }
+    if (current == blocks.size())
+    {
+        size_t block_size = size > 4096 ? size : 4096;
+        blocks.push_back(unique_ptr<char[]>(new char[block_size]));
+        block_sizes.push_back(block_size);
+        used = 0;
+    }
+
+    char *p = blocks[current].get() + used;
+    used += size;
+    return p;
+}
+
+string_view text_arena::store(string_view text)
+{
+    char *p = allocate(text.length());
+    memcpy(p, text.data(), text.length());
+    return string_view(p, text.length());
+}
+
+// Empty the buffer, keeping its memory for the next section
+void input_buffer::reset()
+{
+    lines.clear();
+    cont.clear();
+    if (n_index > 0)
+    {
+        index_slot empty_slot = { string_view(), NO_LINE };
+        fill(index.begin(), index.end(), empty_slot);
+        n_index = 0;
+    }
+    owned.rewind();
+}
+
+// Enter a line in the field index. A line defines the field named by the text
+// before its first '=', but only if the value is not empty. The first line
+// defining a field wins, as it would in a top-down search of the buffer.
+void input_buffer::index_line(unsigned int line_number)
+{
+    const line_info &l = lines[line_number];
+    string_view::size_type eq = l.text.find('=');
+    
+    if (eq == string_view::npos || (l.text.length() <= eq+1 && l.n_cont == 0))
+        return;
+
+    // Keep the table at most half full, so searches stay short
+    if (2 * (n_index + 1) > index.size())
+    {
+        vector<index_slot> old;
+        old.swap(index);
+        index_slot empty_slot = { string_view(), NO_LINE };
+        index.assign(old.empty() ? 64 : 2 * old.size(), empty_slot);
+        n_index = 0;
+        for (unsigned int u = 0; u < old.size(); u++)
+        {
+            if (old[u].line_number == NO_LINE) continue;
+            size_t h = fnv_hash(old[u].name) & (index.size() - 1);
+            while (index[h].line_number != NO_LINE) h = (h + 1) & (index.size() - 1);
+            index[h] = old[u];
+            n_index++;
+        }
+    }
+
+    string_view name = l.text.substr(0, eq);
+    size_t h = fnv_hash(name) & (index.size() - 1);
+    while (index[h].line_number != NO_LINE)
+    {
+        if (index[h].name == name) return;
+        h = (h + 1) & (index.size() - 1);
+    }
+    index[h].name = name;
+    index[h].line_number = line_number;
+    n_index++;
+}
+
+// The line defining a field, or NO_LINE
+unsigned int input_buffer::find(string_view field_name) const
+{
+    if (n_index == 0) return NO_LINE;
+
+    size_t h = fnv_hash(field_name) & (index.size() - 1);
+    while (index[h].line_number != NO_LINE)
+    {
+        if (index[h].name == field_name) return index[h].line_number;
+        h = (h + 1) & (index.size() - 1);
+    }
+    return NO_LINE;
+}
+
+// The complete text of a line, continuation lines joined with "\n"
+string_view input_buffer::joined(unsigned int line_number) const
+{
+    const line_info &l = lines[line_number];
+    if (l.n_cont == 0) return l.text;
+
+    size_t length = l.text.length();
+    for (unsigned int u = 0; u < l.n_cont; u++)
+    {
+        length += 1 + cont[l.first_cont+u].length();
+    }
+
+    char *s = owned.allocate(length);
+    char *p = s;
+    memcpy(p, l.text.data(), l.text.length());
+    p += l.text.length();
+    for (unsigned int u = 0; u < l.n_cont; u++)
+    {
+        string_view c = cont[l.first_cont+u];
+        *p++ = '\n';
+        memcpy(p, c.data(), c.length());
+        p += c.length();
+    }
+    return string_view(s, length);
+}
+
+// Add a line to the buffer
+void input_buffer::add_line(string_view new_line)
+{
+    line_info l = { new_line, (unsigned int) cont.size(), 0 };
+    lines.push_back(l);
+    index_line(count()-1);
+}
+
+// Add a line to the buffer that is not part of the input file
+void input_buffer::add_owned_line(string_view new_line)
+{
+    add_line(owned.store(new_line));
+}
+
+// Add a line name=value that is not part of the input file
+void input_buffer::add_owned_line(string_view name, string_view value)
+{
+    char *p = owned.allocate(name.length() + 1 + value.length());
+    memcpy(p, name.data(), name.length());
+    p[name.length()] = '=';
+    memcpy(p + name.length() + 1, value.data(), value.length());
+    add_line(string_view(p, name.length() + 1 + value.length()));
+}
+
+// Append a line to last line in the buffer
+bool input_buffer::append_line(string_view append_line)
+{
+    if (empty()) return false;
+    
+    cont.push_back(append_line);
+    lines[count()-1].n_cont++;
+    index_line(count()-1);      // an empty value may just have been filled in
+    return true;
+}
+
+// Get the line from the buffer with the given line number
+string_view input_buffer::line(unsigned int line_number) const
+{
+    if (line_number < count())
+        return joined(line_number);
+    else
+        return "";
+}
+
+// Search and return a field from the given field name from the buffer 
+string_view input_buffer::field(string_view field_name) const
+{
+    unsigned int line_number = find(field_name);
+    
+    if (line_number == NO_LINE)
+        return "";
+    
+    return joined(line_number).substr(field_name.length()+1);
+}
+
+// A hash of all lines of the buffer, as read from the input
+unsigned long long input_buffer::hash() const
+{
+    unsigned long long h = fnv_hash(MC2BSBH_VERSION);
+    for (unsigned int u = 0; u < count(); u++)
+    {
+        h = fnv_hash(lines[u].text, h);
+        for (unsigned int c = 0; c < lines[u].n_cont; c++)
+        {
+            h = fnv_hash("\n", h);
+            h = fnv_hash(cont[lines[u].first_cont+c], h);
+        }
+        h = fnv_hash(string_view("\0", 1), h);     // so no line runs into the next
+    }
+    return h;
+}
+
+// Search a field and return its value line by line, without joining them
+void input_buffer::field_lines(string_view field_name, vector<string_view> &parts) const
+{
+    parts.clear();
+
+    unsigned int line_number = find(field_name);
+    if (line_number == NO_LINE)
+        return;
+
+    const line_info &l = lines[line_number];
+    parts.push_back(l.text.substr(field_name.length()+1));
+    for (unsigned int u = 0; u < l.n_cont; u++)
+    {
+        parts.push_back(cont[l.first_cont+u]);
+    }
+}
+
+// Convert a value to double (NAN_D if it is empty). Plain decimal numbers
+// are read with from_chars(); whatever it does not take like strtod() would
+// (leading blanks or '+', hex, out of range) still goes through strtod().
+static double to_double(string_view info)
+{
+    if (info.empty())
+        return input_buffer::NAN_D;
+
+    const char *p = info.data(), *end = p + info.length();
+    if (p < end && *p == '-') p++;
+    bool hex = end - p > 1 && p[0] == '0' && (p[1] == 'x' || p[1] == 'X');
+    if (!hex)
+    {
+        double value;
+        if (from_chars(info.data(), end, value).ec == errc())
+            return value;
+    }
+
+    // strtod() needs a terminated string and the view is not
+    char cbuf[64];
+    if (info.length() < sizeof(cbuf))
+    {
+        memcpy(cbuf, info.data(), info.length());
+        cbuf[info.length()] = 0;
+        return strtod(cbuf, 0);
+    }
+    return strtod(string(info).c_str(), 0);
+}
+
+// Search field in buffer and convert to double (return NAN_D if undefined).
+double input_buffer::field_double(string_view field_name, unsigned int index) const
+{
+    return to_double(extract_field(field(field_name), index));
+}
+
+// Search field in buffer and return the given comma separated part of it
+string_view input_buffer::field_string(string_view field_name, unsigned int index) const
+{
+    return extract_field(field(field_name), index);
+}
+
+// Search field in buffer and convert to long (return NAN_L if undefined) 
+long int input_buffer::field_long(string_view field_name, unsigned int index) const
+{
+    return (long int) field_double(field_name, index);
+}
+
+// Extract field from a string with comma separated substrings 
+string_view extract_field(string_view in_string, unsigned int field_number)
+{
+    string_view::size_type cp = 0;
+    
+    while(field_number > 0 && cp != string_view::npos)
+    {
+        cp = in_string.find(',', cp);
+        if (cp != string_view::npos) cp++;
+        field_number--;
+    }
+    
+    if (in_string.empty() || cp == string_view::npos)
+    {
+        return "";
+    }
+    else
+    {
+        string_view::size_type ep = in_string.find(',', cp);
+        if (ep == string_view::npos)
+        {
+            ep = in_string.length();
+        }
+        
+        return in_string.substr(cp, ep-cp);
+    }
+}
+
+// 64 bit FNV-1a hash of a string, continuing from the given hash
+unsigned long long fnv_hash(string_view s, unsigned long long h)
+{
+    for (string_view::size_type u = 0; u < s.length(); u++)
+    {
+        h ^= (unsigned char) s[u];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+// The name of a numbered field, like C12, in a buffer of the caller
+static string_view numbered_key(char (&cbuf)[16], const char *prefix, unsigned int n)
+{
+    size_t len = strlen(prefix);
+    memcpy(cbuf, prefix, len);
+    char *end = to_chars(cbuf + len, cbuf + sizeof(cbuf), n).ptr;
+    return string_view(cbuf, end - cbuf);
+}
+
+// Put a number into a line the way an ostream with precision(9) would
+static char *put_number(char *p, double value)
+{
+    return to_chars(p, p + 32, value, chars_format::general, 9).ptr;
+}
+
+static char *put_number(char *p, long int value)
+{
+    return to_chars(p, p + 32, value).ptr;
+}
+
+// Remove trailing whitespaces (a line of only whitespaces is left alone)
+static string_view trim_trailing(string_view s)
+{
+    string_view::size_type last = s.find_last_not_of("\n\r\t ");
+    if (last != string_view::npos)
+    {
+        s = s.substr(0, last+1);
+    }
+    return s;
+}
+
+// Remove leading and trailing whitespaces
+static string_view trim(string_view s)
+{
+    string_view::size_type first = s.find_first_not_of("\n\r\t ");
+    if (first == string_view::npos)
+    {
+        return "";
+    }
+    else
+    {
+        string_view::size_type last = s.find_last_not_of("\n\r\t ");
+        return s.substr(first, last+1-first);
+    }
+}
+
+// Get the next line of the text like getline() would; false when there is none
+static bool next_line(string_view text, string_view::size_type &pos, string_view &line)
+{
+    if (pos > text.length()) return false;
+
+    const char *found = (const char *) memchr(text.data() + pos, '\n', text.length() - pos);
+    string_view::size_type eol = found ? found - text.data() : text.length();
+    line = text.substr(pos, eol-pos);
+    pos = eol+1;
+    return true;
+}
+
+// The place of the first [name] line at or after pos, or the length of the
+// text if there is none. A section always starts at such a line, so the
+// text can be cut there and the parts read on their own.
+string_view::size_type section_reader::boundary(string_view text, string_view::size_type pos)
+{
+    if (pos >= text.length()) return text.length();
+    if (pos > 0 && text[pos-1] != '\n')
+    {
+        const char *found = (const char *) memchr(text.data() + pos, '\n', text.length() - pos);
+        if (!found) return text.length();
+        pos = found - text.data() + 1;
+    }
+
+    string_view line;
+    for (;;)
+    {
+        string_view::size_type line_pos = pos;
+        if (!next_line(text, pos, line)) return text.length();
+        line = trim_trailing(line);
+        if (!line.empty() && line[0] == '[' && line[line.length()-1] == ']') return line_pos;
+    }
+}
+
+// Read the next section into buf. Returns false at the end of the text, or
+// if the text is not a calibration file (error() tells then).
+bool section_reader::next(input_buffer &buf)
+{
+    string_view incoming;
+
+    buf.reset();
+    if (!pending.empty())
+    {
+        buf.add_line(trim(pending));
+        pending = string_view();
+        start = pending_pos;
+    }
+
+    for (;;)
+    {
+        string_view::size_type line_pos = pos;
+        if (!next_line(text, pos, incoming)) break;
+        nlines++;
+        incoming = trim_trailing(incoming);
+        if (trace)
+        {
+            *trace << "Read line - " << incoming << endl;
+        }
+
+        if((!incoming.empty()) && (incoming.at(0)!=';'))
+        {
+            // Starting a new section when we see the []-line
+            if (incoming.at(0) == '[' && incoming.at(incoming.length()-1) == ']' && !buf.empty())
+            {
+                pending = incoming;
+                pending_pos = line_pos;
+                end = line_pos;
+                return true;
+            }
+
+            if (incoming.at(0) == ' ')
+            {
+                if (!buf.append_line(trim(incoming)))
+                {
+                    error_text = "Bad Calibration File";
+                    return false;
+                }
+            }
+            else
+            {
+                // Appending line to the buffer
+                if (buf.empty()) start = line_pos;
+                buf.add_line(trim(incoming));
+            }
+        }
+    }
+
+    end = text.length();
+    return !buf.empty();
+}
+
+// The name of a section: its [title] without the brackets and extension
+string_view section_name(const input_buffer &buf)
+{
+    string_view mc_chart_name;
+
+    // Line 0 is always the chart title enclosed in []
+    mc_chart_name = buf.line(0).substr(1, buf.line(0).length()-2);
+    string_view::size_type find_end = mc_chart_name.find_last_of('.');
+    if (find_end != string_view::npos)
+    {
+        mc_chart_name=mc_chart_name.substr(0,find_end);
+    }
+    return mc_chart_name;
+}
+
+// The name of the chart of a section: its FN without the extension
+string_view chart_name(const input_buffer &buf)
+{
+    string_view name = buf.field("FN");
+    string_view::size_type find_end = name.find_last_of('.');
+    if (find_end != string_view::npos)
+    {
+        name=name.substr(0,find_end);
+    }
+    return name;
+}
+
+// The number in a field name like C12 (prefix "C"), or 0 if it is not one.
+// Names with leading zeros are other fields, since C01 is not looked for.
+static unsigned int point_number(string_view name, char prefix)
+{
+    if (name.length() < 2 || name.length() > 8 || name[0] != prefix || name[1] == '0') return 0;
+
+    unsigned int n = 0;
+    for (string_view::size_type u = 1; u < name.length(); u++)
+    {
+        if (name[u] < '0' || name[u] > '9') return 0;
+        n = n * 10 + (name[u] - '0');
+    }
+    return n;
+}
+
+// Count the points 1, 2, ... up to the first one without a value
+static unsigned int point_count(const vector<unsigned char> &points)
+{
+    unsigned int n = 1;
+    while (n < points.size() && points[n]) n++;
+    return n - 1;
+}
+
+// A line of the section, as input_buffer::add_line() would see it
+void section_scanner::add_line(string_view line)
+{
+    last_field = 0;
+    last_point = 0;
+
+    string_view::size_type eq = line.find('=');
+    if (eq == string_view::npos) return;
+
+    string_view name = line.substr(0, eq);
+    string_view value = line.substr(eq+1);
+    scanned_field *f = name == "FN" ? &fn : name == "NA" ? &na : name == "SC" ? &sc : 0;
+    if (f)
+    {
+        if (f->defined) return;
+        f->value = value;
+        f->is_joined = false;
+        f->defined = !value.empty();
+        last_field = f;         // an empty value may still get continuation lines
+        return;
+    }
+
+    vector<unsigned char> *points = 0;
+    unsigned int n = point_number(name, 'C');
+    if (n > 0) points = &c_points;
+    else if ((n = point_number(name, 'B')) > 0) points = &b_points;
+    if (!points || n > (1u << 20)) return;
+
+    if (points->size() <= n) points->resize(n+1, 0);
+    if (!value.empty()) (*points)[n] = 1;
+    else                last_point = &(*points)[n];
+}
+
+// A continuation line, as input_buffer::append_line() would see it
+void section_scanner::append_line(string_view line)
+{
+    if (last_point) *last_point = 1;
+    if (!last_field) return;
+
+    if (!last_field->is_joined)
+    {
+        last_field->joined.assign(last_field->value.data(), last_field->value.length());
+        last_field->is_joined = true;
+    }
+    last_field->joined += '\n';
+    last_field->joined.append(line.data(), line.length());
+    last_field->value = last_field->joined;
+    last_field->defined = true;
+}
+
+// Find the next section and sum it up; false at the end or on an error.
+// The lines are split like section_reader does it (the line ends are found
+// with memchr(), which is vectorized), but nothing is stored.
+bool section_scanner::next(section_summary &summary)
+{
+    fn.defined = na.defined = sc.defined = false;
+    fn.value = na.value = sc.value = string_view();
+    fn.is_joined = na.is_joined = sc.is_joined = false;
+    c_points.clear();
+    b_points.clear();
+    last_field = 0;
+    last_point = 0;
+
+    bool in_section = false;
+    if (!pending.empty())
+    {
+        add_line(trim(pending));
+        pending = string_view();
+        in_section = true;
+    }
+
+    string_view incoming;
+    while (next_line(text, pos, incoming))
+    {
+        nlines++;
+        incoming = trim_trailing(incoming);
+        if (incoming.empty() || incoming[0] == ';') continue;
+
+        if (incoming[0] == '[' && incoming[incoming.length()-1] == ']' && in_section)
+        {
+            pending = incoming;
+            break;
+        }
+
+        if (incoming[0] == ' ')
+        {
+            if (!in_section)
+            {
+                error_text = "Bad Calibration File";
+                return false;
+            }
+            append_line(trim(incoming));
+        }
+        else
+        {
+            add_line(incoming[0] > ' ' ? incoming : trim(incoming));   // most lines need no trimming
+            in_section = true;
+        }
+    }
+    if (!in_section) return false;
+
+    string_view chart = fn.value;
+    string_view::size_type find_end = chart.find_last_of('.');
+    if (find_end != string_view::npos)
+    {
+        chart = chart.substr(0, find_end);
+    }
+
+    summary.chart = fn.defined ? chart : string_view();
+    summary.title = na.defined ? na.value : string_view();
+    summary.scale = sc.defined ? sc.value : string_view();
+    summary.ref_points = point_count(c_points);
+    summary.ply_points = point_count(b_points);
+    return true;
+}
+
+// Add the fields of a KNP/ or BSB/ command to the section, in one pass
+// over the command. The fields end at the first empty one.
+static void add_command_fields(input_buffer &buf, string_view fields)
+{
+    const char *p = fields.data(), *end = p + fields.length();
+    while (p < end)
+    {
+        const char *comma = (const char *) memchr(p, ',', end - p);
+        if (!comma) comma = end;
+        if (comma == p) break;
+        buf.add_line(string_view(p, comma - p));
+        p = comma + 1;
+    }
+}
+
+// Read a line of the CR field in one pass. It is split at tabs and carriage
+// returns; the pieces are copied to the header as comments or, if they start
+// with BSBHDR, carried out as commands, as views into the input. Only the
+// first non-empty KNP/ and BSB/ command of the section counts: a later one
+// would only add the fields of the first again, and the first line to give
+// a field a value wins, so it is passed over.
+struct comment_state
+{
+    bool knp_done, bsb_done;    // a KNP/ or BSB/ command has been carried out
+    unsigned int addn;          // the number of the next ADD<n> line
+    comment_state() : knp_done(false), bsb_done(false), addn(1) {}
+};
+
+static void read_comment(input_buffer &buf, string_view part, comment_state &state, ostream &outFile)
+{
+    const char *p = part.data(), *end = p + part.length();
+    char key[16];
+    for (;;)
+    {
+        const char *brk = p;
+        while (brk < end && *brk != '\t' && *brk != '\r') brk++;
+        string_view cline(p, brk - p);
+
+        if (cline.substr(0,6) == "BSBHDR")
+        {
+            cline.remove_prefix(6);
+            while (!cline.empty() && cline[0] == ' ') cline.remove_prefix(1);
+
+            if (cline.substr(0,4) == "KNP/")
+            {
+                if (!state.knp_done && cline.length() > 4)
+                {
+                    state.knp_done = true;
+                    add_command_fields(buf, cline.substr(4));
+                }
+            }
+            else if (cline.substr(0,4) == "BSB/")
+            {
+                if (!state.bsb_done && cline.length() > 4)
+                {
+                    state.bsb_done = true;
+                    add_command_fields(buf, cline.substr(4));
+                }
+            }
+            else
+            {
+                buf.add_owned_line(numbered_key(key, "ADD", state.addn++), cline);
+            }
+        }
+        else
+        {
+            outFile << "! " << cline << endl;
+        }
+
+        if (brk == end) break;
+        p = brk + 1;
+    }
+}
+
+// The polynomials of WPX/, WPY/, PWX/ and PWY/ map a point (a,b) to a value
+// with the terms 1, a, b, a^2, ab, b^2, a^3, a^2b, ab^2, b^3; a polynomial of
+// order 1 or 2 has only the first 3 or 6 of them.
+static const unsigned int POLY_TERMS = chart_transform::TERMS;
+
+static unsigned int poly_terms(unsigned int order)
+{
+    return (order + 1) * (order + 2) / 2;
+}
+
+// The place of the term a^i b^j
+static unsigned int poly_term(unsigned int i, unsigned int j)
+{
+    unsigned int degree = i + j;
+    return degree * (degree + 1) / 2 + j;
+}
+
+static double poly_value(const double (&c)[POLY_TERMS], double a, double b)
+{
+    return c[0] + c[1]*a + c[2]*b + c[3]*a*a + c[4]*a*b + c[5]*b*b
+         + c[6]*a*a*a + c[7]*a*a*b + c[8]*a*b*b + c[9]*b*b*b;
+}
+
+// Fit two polynomials of the given order by least squares, cp to p and cq to
+// q, over the points in rows of 4 values: a, b, p and q are the columns ia,
+// ib, ip and iq of a row. The fit is solved for a and b centred and scaled
+// to [-1,1], so that the powers of a and b stay apart, with a Householder QR
+// of the design matrix; the coefficients are then expanded back to the raw
+// a and b. False if the points do not pin down a fit of this order.
+static bool poly_fit(const vector<double> &rows, unsigned int ia, unsigned int ib,
+                     unsigned int ip, unsigned int iq, unsigned int order,
+                     double (&cp)[POLY_TERMS], double (&cq)[POLY_TERMS])
+{
+    size_t n = rows.size() / 4;
+    unsigned int m = poly_terms(order);
+    if (n < m) return false;
+
+    double ca = 0.0, cb = 0.0, sa = 0.0, sb = 0.0;
+    for (size_t i = 0; i < n; i++)
+    {
+        ca += rows[4*i+ia];
+        cb += rows[4*i+ib];
+    }
+    ca /= n;
+    cb /= n;
+    for (size_t i = 0; i < n; i++)
+    {
+        sa = max(sa, fabs(rows[4*i+ia] - ca));
+        sb = max(sb, fabs(rows[4*i+ib] - cb));
+    }
+    if (sa == 0.0 || sb == 0.0) return false;
+
+    // The design matrix by columns, followed by the columns of p and q. A
+    // column is contiguous, so the loops below run over plain arrays.
+    static thread_local vector<double> mat;     // its memory is reused
+    mat.resize(n * (m + 2));
+    for (size_t i = 0; i < n; i++)
+    {
+        double pu[4] = { 1.0 }, pv[4] = { 1.0 };
+        for (unsigned int k = 1; k <= order; k++)
+        {
+            pu[k] = pu[k-1] * (rows[4*i+ia] - ca) / sa;
+            pv[k] = pv[k-1] * (rows[4*i+ib] - cb) / sb;
+        }
+        for (unsigned int degree = 0; degree <= order; degree++)
+            for (unsigned int j = 0; j <= degree; j++)
+                mat[poly_term(degree-j, j)*n + i] = pu[degree-j] * pv[j];
+        mat[m*n + i] = rows[4*i+ip];
+        mat[(m+1)*n + i] = rows[4*i+iq];
+    }
+
+    // Householder QR; the reflections are applied to p and q as well. R is
+    // left above the diagonal of the matrix, its diagonal in rdiag.
+    double rdiag[POLY_TERMS], rmax = 0.0;
+    for (unsigned int k = 0; k < m; k++)
+    {
+        double *ck = &mat[k*n];
+        double norm = 0.0;
+        for (size_t i = k; i < n; i++) norm += ck[i] * ck[i];
+        norm = sqrt(norm);
+        if (norm == 0.0) return false;
+
+        double alpha = ck[k] > 0.0 ? -norm : norm;
+        ck[k] -= alpha;
+        double vnorm = norm * (norm + fabs(ck[k] + alpha));    // v.v / 2
+        for (unsigned int col = k + 1; col < m + 2; col++)
+        {
+            double *cj = &mat[col*n];
+            double s = 0.0;
+            for (size_t i = k; i < n; i++) s += ck[i] * cj[i];
+            s /= vnorm;
+            for (size_t i = k; i < n; i++) cj[i] -= s * ck[i];
+        }
+        rdiag[k] = alpha;
+        rmax = max(rmax, fabs(alpha));
+    }
+    for (unsigned int k = 0; k < m; k++)
+    {
+        if (fabs(rdiag[k]) < 1e-10 * rmax) return false;   // points on a line or curve
+    }
+
+    // Back substitution, then expand each term ((a-ca)/sa)^i ((b-cb)/sb)^j
+    static const double binomial[4][4] = { {1}, {1,1}, {1,2,1}, {1,3,3,1} };
+    double *coef[2] = { cp, cq };
+    for (unsigned int r = 0; r < 2; r++)
+    {
+        const double *rhs = &mat[(m+r)*n];
+        double x[POLY_TERMS];
+        for (int k = m - 1; k >= 0; k--)
+        {
+            double s = rhs[k];
+            for (unsigned int col = k + 1; col < m; col++) s -= mat[col*n + k] * x[col];
+            x[k] = s / rdiag[k];
+        }
+
+        double *c = coef[r];
+        for (unsigned int t = 0; t < POLY_TERMS; t++) c[t] = 0.0;
+        for (unsigned int degree = 0; degree <= order; degree++)
+            for (unsigned int j = 0; j <= degree; j++)
+            {
+                unsigned int i = degree - j;
+                double term = x[poly_term(i, j)] / (pow(sa, i) * pow(sb, j));
+                for (unsigned int k = 0; k <= i; k++)
+                    for (unsigned int l = 0; l <= j; l++)
+                        c[poly_term(k, l)] += term * binomial[i][k] * pow(-ca, i-k)
+                                                   * binomial[j][l] * pow(-cb, j-l);
+            }
+    }
+    return true;
+}
+
+// Write a polynomial line: the name, the order and all ten coefficients,
+// each with as many digits as it takes to read it back exactly
+static void write_polynomial(ostream &outFile, const char *name, unsigned int order,
+                             const double (&c)[POLY_TERMS])
+{
+    char pline[16 + POLY_TERMS * 32], *pp_end;
+    memcpy(pline, name, 4);
+    pp_end = put_number(pline + 4, (long int) order);
+    for (unsigned int t = 0; t < POLY_TERMS; t++)
+    {
+        *pp_end++ = ',';
+        pp_end = to_chars(pp_end, pp_end + 32, c[t]).ptr;
+    }
+    *pp_end++ = '\n';
+    outFile.write(pline, pp_end - pline);
+}
+
+// Fit the polynomials to the reference points, given in rows of x, y, lat
+// and lon: WPX/ and WPY/ (longitude and latitude to pixel x and y) and PWX/
+// and PWY/ (pixel to longitude and latitude). The order grows with the
+// number of points, so there are always some points to spare: 1 from 3
+// points, 2 from 10 and 3 from 20, up to max_order. On a chart across the
+// 180th meridian (CPH/180.0) the longitudes of the rows are moved to run
+// from 0 to 360.
+bool chart_transform::fit(vector<double> &refs, bool across_180, unsigned int max_order)
+{
+    order = 0;
+    cross_180 = across_180;
+    size_t n = refs.size() / 4;
+    for (size_t i = 0; i < n; i++)
+    {
+        for (unsigned int v = 0; v < 4; v++)
+        {
+            if (refs[4*i+v] == input_buffer::NAN_D) return false;   // a point without a value
+        }
+        if (cross_180 && refs[4*i+3] < 0.0) refs[4*i+3] += 360.0;
+    }
+
+    order = min(n >= 20 ? 3u : n >= 10 ? 2u : 1u, max_order);
+    while (order > 0 && !(poly_fit(refs, 3, 2, 0, 1, order, wpx, wpy) &&
+                          poly_fit(refs, 0, 1, 3, 2, order, pwx, pwy)))
+    {
+        order--;
+    }
+    return order > 0;
+}
+
+// Fit the polynomials to the C<n> points of a section, read the way
+// build_header() reads them into the REF/ lines
+bool chart_transform::fit(const input_buffer &buf)
+{
+    static thread_local vector<double> refs;
+    refs.clear();
+    long int refx, maxlonx=0, minlonx=0;
+    double lon, maxlon=-181.0, minlon=181.0;
+    char key[16];
+    for (unsigned int cnt = 1; ; cnt++)
+    {
+        string_view sv = buf.field(numbered_key(key, "C", cnt));
+        if (sv.empty())
+            break;
+
+        refx = (long int) to_double(extract_field(sv,0));
+        lon  = to_double(extract_field(sv,3));
+        if (lon>180.0) lon=lon-360.0;
+        if (lon>maxlon) { maxlon=lon; maxlonx=refx;}
+        if (lon<minlon) { minlon=lon; minlonx=refx;}
+
+        refs.push_back(refx);
+        refs.push_back((long int) to_double(extract_field(sv,1)));
+        refs.push_back(to_double(extract_field(sv,2)));
+        refs.push_back(lon);
+    }
+    return fit(refs, (maxlon*minlon)<0.0 && (maxlonx < minlonx));
+}
+
+// Write the polynomials, and an ERR/ line for every reference point (the
+// rows the fit was made from) with how far they miss it in x, y, longitude
+// and latitude
+void chart_transform::write(ostream &outFile, const vector<double> &refs) const
+{
+    if (order == 0) return;
+
+    write_polynomial(outFile, "WPX/", order, wpx);
+    write_polynomial(outFile, "WPY/", order, wpy);
+    write_polynomial(outFile, "PWX/", order, pwx);
+    write_polynomial(outFile, "PWY/", order, pwy);
+
+    char pline[192], *pp_end;
+    for (size_t i = 0; i < refs.size() / 4; i++)
+    {
+        double x = refs[4*i], y = refs[4*i+1], lat = refs[4*i+2], lon = refs[4*i+3];
+        memcpy(pline, "ERR/", 4);
+        pp_end = put_number(pline + 4, (long int) (i + 1));
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, poly_value(wpx, lon, lat) - x);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, poly_value(wpy, lon, lat) - y);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, poly_value(pwx, x, y) - lon);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, poly_value(pwy, x, y) - lat);
+        *pp_end++ = '\n';
+        outFile.write(pline, pp_end - pline);
+    }
+}
+
+// Two doubles at once. The transforms work on two points per step with the
+// operations of poly_value() in the same order, so every point comes out
+// exactly as poly_value() would give it, and exactly as the ERR/ lines
+// were worked out.
+typedef double double2 __attribute__((vector_size(16)));
+
+static inline double2 poly_value2(const double (&c)[POLY_TERMS], double2 a, double2 b)
+{
+    return c[0] + c[1]*a + c[2]*b + c[3]*a*a + c[4]*a*b + c[5]*b*b
+         + c[6]*a*a*a + c[7]*a*a*b + c[8]*a*b*b + c[9]*b*b*b;
+}
+
+static inline double2 load2(const double *p)
+{
+    double2 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline void store2(double *p, double2 v)
+{
+    memcpy(p, &v, sizeof(v));
+}
+
+// Pixel to latitude and longitude for n points, in separate arrays.
+// Longitudes come out from -180 to 180.
+void chart_transform::to_geo(size_t n, const double *x, const double *y, double *lat, double *lon) const
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        double2 vx = load2(x + i), vy = load2(y + i);
+        double2 vlon = poly_value2(pwx, vx, vy);
+        if (cross_180) vlon = vlon > 180.0 ? vlon - 360.0 : vlon;
+        store2(lon + i, vlon);
+        store2(lat + i, poly_value2(pwy, vx, vy));
+    }
+    for (; i < n; i++)
+    {
+        lon[i] = poly_value(pwx, x[i], y[i]);
+        if (cross_180 && lon[i] > 180.0) lon[i] -= 360.0;
+        lat[i] = poly_value(pwy, x[i], y[i]);
+    }
+}
+
+// Latitude and longitude to pixel for n points, in separate arrays
+void chart_transform::to_pixel(size_t n, const double *lat, const double *lon, double *x, double *y) const
+{
+    size_t i = 0;
+    for (; i + 2 <= n; i += 2)
+    {
+        double2 vlat = load2(lat + i), vlon = load2(lon + i);
+        if (cross_180) vlon = vlon < 0.0 ? vlon + 360.0 : vlon;
+        store2(x + i, poly_value2(wpx, vlon, vlat));
+        store2(y + i, poly_value2(wpy, vlon, vlat));
+    }
+    for (; i < n; i++)
+    {
+        double l = cross_180 && lon[i] < 0.0 ? lon[i] + 360.0 : lon[i];
+        x[i] = poly_value(wpx, l, lat[i]);
+        y[i] = poly_value(wpy, l, lat[i]);
+    }
+}
+
+// Write the BSB header for a section. The strings are stored in an input_buffer.
+// The number of REF and PLY points written goes into counts, if given. With
+// polynomials, the header ends with the polynomials fitted to the REF points.
+// The points and a few fields go into values, if given.
+void build_header(input_buffer &buf, ostream &outFile, header_counts *counts, bool polynomials,
+                  chart_values *values)
+{
+    // Calculate derived values
+    long int sc = buf.field_long("SC"); 
+    double   dx = buf.field_double("DX"); 
+    double   dy = buf.field_double("DY");
+    long int du = 0;
+    
+    if (sc != 0   && sc != buf.NAN_L &&
+        dx != 0.0 && dx != buf.NAN_D &&
+        dy != 0.0 && dy != buf.NAN_D)
+    {
+        du = (long int) ((sc * 2.54 / (( dx + dy ) / 2.0 * 100.0)) + 0.5);
+    }
+    
+    long int projection;
+    projection = buf.field_long("PR");
+    if ((projection==buf.NAN_L)||(projection>3)) projection = 0;
+    string_view pr = extract_field("UNKNOWN,MERCATOR,TRANSVERSE MERCATOR,LAMBERT CONFORMAL CONIC", projection);
+       
+    long int i = buf.field_long("DU");
+    if (i==buf.NAN_L) i = 0;
+    string_view un = extract_field("UNKNOWN,METERS,FEET,FATHOMS", i);
+    
+    // Output the file
+    outFile << "! Created by mc2bsbh " << MC2BSBH_VERSION << " - Use at your own risk!" << endl;
+    
+    // In this section the CR field is processed. The CR field is the CHARTCAL.DIR comment and
+    // it is made of multiple lines first of which is CR=... and next starts with a space char.
+    // Each line may be a comment (to be just copied in the BSB header) or a command.
+    // Command starts with the keyword BSBHDR and may be of 2 types:
+    //    1) commands for superseeding default BSB and KNP values:
+    //		  - these commands are in the form BSBHDR KNP/SC=xxx,PP=yyy
+    //    2) commands for adding a totally new line to the header
+    //		  - these commands never use KNP/ or BSB/ parameter.
+    
+    static thread_local vector<string_view> comment;    // its memory is reused
+    buf.field_lines("CR", comment);
+    comment_state state;
+    char key[16];
+    for (unsigned int u = 0; u < comment.size(); u++)
+    {
+        read_comment(buf, comment[u], state, outFile);
+    }
+   
+    string_view pp,pi,sp,sk,ta,sd;
+    
+    if (buf.field_double("PP")==buf.NAN_D) pp="UNKNOWN"; else pp=buf.field("PP");
+    if (buf.field_double("PI")==buf.NAN_D) pi="UNKNOWN"; else pi=buf.field("PI");
+    if (buf.field_double("SP")==buf.NAN_D) sp="UNKNOWN"; else sp=buf.field("SP");
+    if (buf.field_double("SK")==buf.NAN_D) sk="0.0";     else sk=buf.field("SK");
+    if (buf.field_double("TA")==buf.NAN_D) ta="90.0";    else ta=buf.field("TA");
+    if (buf.field("SD").empty())           sd="UNKNOWN"; else sd=buf.field("SD");     
+    
+    outFile << "VER/2.0" << endl;
+    
+    outFile << "BSB/NA=" << buf.field("NA") << endl;
+    outFile << "    NU=" << buf.field("NU") << ",RA=" << buf.field("WI") << "," << buf.field("HE") << ",DU=" << du << endl;
+
+    outFile << "KNP/SC=" << sc << ",GD=" << buf.field("GD") << ",PR=" << pr;
+
+    double lon0 = buf.field_double("LON0");
+    if ((lon0!=buf.NAN_D)&&(projection==2)&&(pp=="UNKNOWN"))
+         outFile << ",PP=" << lon0 << endl;
+    else
+         outFile << ",PP=" << pp << endl;
+
+    outFile << "    PI=" << pi << ",SP=" << sp << ",SK=" << sk << ",TA=" << ta << endl;
+    outFile << "    UN=" << un << ",SD=" << sd << endl;
+    outFile << "    DX=" << dx << ",DY=" << dy << endl;
+
+    unsigned int cnt;
+    string_view sv;
+    
+    cnt=1;
+    for(;;)
+    {
+        sv = buf.field(numbered_key(key, "ADD", cnt));
+        if (sv.empty())
+            break;
+
+        outFile << sv << endl;
+        
+        cnt++;
+    }
+    
+    outFile << "OST/1" << endl;
+    
+    long int refx, refy, maxlonx=0, minlonx=0;
+    double lat, lon, maxlon=-181.0, minlon=181.0;
+    
+    // The points are formatted with to_chars() into a line buffer; the
+    // text is the same as that of the stream with precision(9).
+    char pline[192], *pp_end;
+    static thread_local vector<double> own_refs;    // x, y, lat, lon of every point, for the polynomials
+    vector<double> &refs = values ? values->refs : own_refs;
+    bool keep_refs = polynomials || values;
+    refs.clear();
+    
+	outFile.precision(9);
+    cnt=1;
+    for(;;)
+    {
+        sv = buf.field(numbered_key(key, "C", cnt));
+        if (sv.empty())
+            break;
+            
+        refx = (long int) to_double(extract_field(sv,0));
+        refy = (long int) to_double(extract_field(sv,1));
+        lat  = to_double(extract_field(sv,2));
+        lon  = to_double(extract_field(sv,3));
+        
+        if (lon>180.0) lon=lon-360.0;
+        if (lon>maxlon) { maxlon=lon; maxlonx=refx;}
+        if (lon<minlon) { minlon=lon; minlonx=refx;}
+        
+        memcpy(pline, "REF/", 4);
+        pp_end = put_number(pline + 4, (long int) cnt);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, refx);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, refy);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, lat);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, lon);
+        *pp_end++ = '\n';
+        outFile.write(pline, pp_end - pline);
+        if (keep_refs)
+        {
+            refs.push_back(refx);
+            refs.push_back(refy);
+            refs.push_back(lat);
+            refs.push_back(lon);
+        }
+        cnt++;
+    }
+    if (counts) counts->ref_points = cnt-1;
+    
+    bool cross_180 = (maxlon*minlon)<0.0 && (maxlonx < minlonx);
+    if (values)
+    {
+        values->chart = chart_name(buf);
+        values->title = buf.field("NA");
+        values->scale = sc;
+        values->cross_180 = cross_180;
+        values->ply.clear();
+    }
+    if(cross_180)
+    {
+        outFile << "CPH/180.0" << endl;
+    }
+    else
+    {
+        outFile << "CPH/0.0" << endl;
+    }
+        
+    cnt=1;
+    for(;;)
+    {
+        sv = buf.field(numbered_key(key, "B", cnt));
+        if (sv.empty())
+            break;
+            
+        lat  = to_double(extract_field(sv,0));
+        lon  = to_double(extract_field(sv,1));
+        
+        if (lon>180.0) lon=lon-360.0;
+         
+        memcpy(pline, "PLY/", 4);
+        pp_end = put_number(pline + 4, (long int) cnt);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, lat);
+        *pp_end++ = ',';
+        pp_end = put_number(pp_end, lon);
+        *pp_end++ = '\n';
+        outFile.write(pline, pp_end - pline);
+        if (values)
+        {
+            values->ply.push_back(lat);
+            values->ply.push_back(lon);
+        }
+        
+        cnt++;
+    }
+    if (counts) counts->ply_points = cnt-1;
+    
+    sv = buf.field("DS");
+    memcpy(pline, "DTM/", 4);
+    pp_end = put_number(pline + 4, to_double(extract_field(sv,0))*3600.0);
+    *pp_end++ = ',';
+    pp_end = put_number(pp_end, to_double(extract_field(sv,1))*3600.0);
+    *pp_end++ = '\n';
+    outFile.write(pline, pp_end - pline);
+
+    if (polynomials)
+    {
+        // The fit moves the longitudes of the rows, values keeps them as written
+        static thread_local vector<double> fit_refs;
+        vector<double> &rows = values ? fit_refs : refs;
+        if (values) fit_refs = refs;
+        chart_transform transform;
+        if (transform.fit(rows, cross_180)) transform.write(outFile, rows);
+    }
+}
+
+// A stream buffer that appends to a string
+class string_appender : public streambuf
+{
+private:
+    string &text;
+protected:
+    int overflow(int c)
+    {
+        if (c != EOF) text += (char) c;
+        return c;
+    }
+    streamsize xsputn(const char *s, streamsize n)
+    {
+        text.append(s, n);
+        return n;
+    }
+public:
+    string_appender(string &out_text) : text(out_text) {}
+};
+
+// Convert a section into the text of its BSB header. The text replaces the
+// contents of the string, whose memory is reused. The BSBHDR overrides of
+// the comment are added to the section.
+void convert_header(input_buffer &buf, string &text, header_counts *counts, bool polynomials,
+                    chart_values *values)
+{
+    text.clear();
+    string_appender appender ( text );
+    ostream outFile ( &appender );
+    build_header(buf, outFile, counts, polynomials, values);
+}
+
+// Write a whole file with a single write(). It is written under a temporary
+// name and then renamed, so a crash never leaves half a header behind. The
+// temporary name is new for every write, so threads writing the same file
+// at once each rename a whole file of their own into place.
+bool write_file(const string &filename, const string &text)
+{
+    static atomic<unsigned long> writes(0);
+    string tmp_name = filename + ".tmp" + to_string(getpid()) + "." + to_string(writes++);
+
+    int fd = ::open(tmp_name.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0666);
+    if (fd < 0) return false;
+
+    const char *p = text.data();
+    size_t left = text.length();
+    while (left > 0)
+    {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) break;
+        p += n;
+        left -= n;
+    }
+
+    if (::close(fd) != 0 || left > 0 || rename(tmp_name.c_str(), filename.c_str()) != 0)
+    {
+        unlink(tmp_name.c_str());
+        return false;
+    }
+    return true;
+}
+
+// Put a string into JSON text, in quotes. The input is taken to be Latin-1,
+// like the degree signs of MapCal.
+void json_string(string &out, string_view s)
+{
+    char cbuf[8];
+    out += '"';
+    for (string_view::size_type u = 0; u < s.length(); u++)
+    {
+        unsigned char c = s[u];
+        if (c == '"' || c == '\\')
+        {
+            out += '\\';
+            out += c;
+        }
+        else if (c < 0x20 || c >= 0x7f)
+        {
+            snprintf(cbuf, sizeof(cbuf), "\\u%04x", c);
+            out += cbuf;
+        }
+        else
+        {
+            out += c;
+        }
+    }
+    out += '"';
+}
+
+// Append a longitude and latitude as a GeoJSON position
+static void put_position(string &text, double lon, double lat)
+{
+    char cbuf[80], *p = cbuf;
+    *p++ = '[';
+    p = put_number(p, lon);
+    *p++ = ',';
+    p = put_number(p, lat);
+    *p++ = ']';
+    text.append(cbuf, p - cbuf);
+}
+
+// A FeatureCollection with a feature on each line: the outline, if the
+// chart has one (3 points or more, all with a value), then the REF points
+bool geojson_sink::make(const chart_values &values, string &text) const
+{
+    const double NAN_D = input_buffer::NAN_D;
+    text.clear();
+    text += "{\"type\":\"FeatureCollection\",\"features\":[";
+    string properties = "{\"chart\":";
+    json_string(properties, values.chart);
+    size_t chart_end = properties.length();
+    bool first = true;
+
+    size_t n = values.ply.size() / 2;
+    bool outline = n >= 3;
+    for (size_t i = 0; i < 2*n; i++)
+    {
+        if (values.ply[i] == NAN_D) outline = false;
+    }
+    if (outline)
+    {
+        // Like the coverage index: a side longer than half the world
+        // crosses the 180th meridian instead
+        bool cross_180 = false;
+        for (size_t i = 0; i < n; i++)
+        {
+            if (fabs(values.ply[2*i+1] - values.ply[2*((i+1)%n)+1]) > 180.0) cross_180 = true;
+        }
+        vector<double> lon(n), lat(n);
+        double area = 0.0;
+        for (size_t i = 0; i < n; i++)
+        {
+            lat[i] = values.ply[2*i];
+            lon[i] = values.ply[2*i+1];
+            if (cross_180 && lon[i] < 0.0) lon[i] += 360.0;
+        }
+        for (size_t i = 0; i < n; i++)
+        {
+            area += lon[i] * lat[(i+1)%n] - lon[(i+1)%n] * lat[i];
+        }
+
+        properties += ",\"title\":";
+        json_string(properties, values.title);
+        properties += ",\"scale\":";
+        properties += values.scale == input_buffer::NAN_L ? string("null") : to_string(values.scale);
+        text += "\n{\"type\":\"Feature\",\"properties\":";
+        text += properties;
+        text += "},\"geometry\":{\"type\":\"Polygon\",\"coordinates\":[[";
+        // The outer ring runs counterclockwise and ends where it starts
+        for (size_t k = 0; k <= n; k++)
+        {
+            size_t i = area >= 0.0 ? k % n : (n - k) % n;
+            if (k > 0) text += ',';
+            put_position(text, lon[i], lat[i]);
+        }
+        text += "]]}}";
+        properties.resize(chart_end);
+        first = false;
+    }
+
+    char cbuf[80];
+    for (size_t i = 0; i < values.refs.size() / 4; i++)
+    {
+        const double *r = &values.refs[4*i];
+        if (r[0] == NAN_D || r[1] == NAN_D || r[2] == NAN_D || r[3] == NAN_D) continue;
+
+        text += first ? "\n" : ",\n";
+        text += "{\"type\":\"Feature\",\"properties\":";
+        text += properties;
+        char *p = cbuf;
+        memcpy(p, ",\"ref\":", 7);
+        p = put_number(p + 7, (long int) (i + 1));
+        memcpy(p, ",\"x\":", 5);
+        p = put_number(p + 5, (long int) r[0]);
+        memcpy(p, ",\"y\":", 5);
+        p = put_number(p + 5, (long int) r[1]);
+        text.append(cbuf, p - cbuf);
+        text += "},\"geometry\":{\"type\":\"Point\",\"coordinates\":";
+        put_position(text, r[3], r[2]);
+        text += "}}";
+        first = false;
+    }
+    text += "\n]}\n";
+    return !first;
+}
+
+// The affine transform of the REF points, as a GDAL GeoTransform: the
+// longitude and latitude of the top left corner of the chart and their
+// steps per pixel in x and y. The REF points are taken to be at the pixel
+// positions GDAL gives them, counted from that corner.
+static bool geo_transform(const chart_values &values, double (&gt)[6])
+{
+    static thread_local vector<double> refs;
+    refs = values.refs;
+    chart_transform transform;
+    if (!transform.fit(refs, values.cross_180, 1)) return false;
+
+    const double *lon = transform.pixel_to_lon(), *lat = transform.pixel_to_lat();
+    gt[0] = lon[0];
+    gt[1] = lon[1];
+    gt[2] = lon[2];
+    gt[3] = lat[0];
+    gt[4] = lat[1];
+    gt[5] = lat[2];
+    return true;
+}
+
+// The six lines of a world file, for the centre of the top left pixel
+bool world_file_sink::make(const chart_values &values, string &text) const
+{
+    double gt[6];
+    if (!geo_transform(values, gt)) return false;
+
+    double lines[6] = { gt[1], gt[4], gt[2], gt[5],
+                        gt[0] + 0.5 * gt[1] + 0.5 * gt[2], gt[3] + 0.5 * gt[4] + 0.5 * gt[5] };
+    char cbuf[40];
+    text.clear();
+    for (unsigned int u = 0; u < 6; u++)
+    {
+        char *p = to_chars(cbuf, cbuf + 32, lines[u]).ptr;
+        *p++ = '\n';
+        text.append(cbuf, p - cbuf);
+    }
+    return true;
+}
+
+// WGS 84 in the WKT GDAL writes for EPSG:4326, quoted for XML
+static const char WGS84_WKT[] =
+    "GEOGCS[&quot;WGS 84&quot;,DATUM[&quot;WGS_1984&quot;,SPHEROID[&quot;WGS 84&quot;,6378137,298.257223563,"
+    "AUTHORITY[&quot;EPSG&quot;,&quot;7030&quot;]],AUTHORITY[&quot;EPSG&quot;,&quot;6326&quot;]],"
+    "PRIMEM[&quot;Greenwich&quot;,0,AUTHORITY[&quot;EPSG&quot;,&quot;8901&quot;]],"
+    "UNIT[&quot;degree&quot;,0.0174532925199433,AUTHORITY[&quot;EPSG&quot;,&quot;9122&quot;]],"
+    "AXIS[&quot;Latitude&quot;,NORTH],AXIS[&quot;Longitude&quot;,EAST],AUTHORITY[&quot;EPSG&quot;,&quot;4326&quot;]]";
+
+// A PAMDataset with the SRS, the GeoTransform and the GCPs
+bool aux_xml_sink::make(const chart_values &values, string &text) const
+{
+    double gt[6];
+    if (!geo_transform(values, gt)) return false;
+
+    char cbuf[256], *p;
+    text.clear();
+    text += "<PAMDataset>\n  <SRS dataAxisToSRSAxisMapping=\"2,1\">";
+    text += WGS84_WKT;
+    text += "</SRS>\n  <GeoTransform>";
+    for (unsigned int u = 0; u < 6; u++)
+    {
+        if (u > 0) text += ", ";
+        text.append(cbuf, to_chars(cbuf, cbuf + 32, gt[u]).ptr - cbuf);
+    }
+    text += "</GeoTransform>\n  <GCPList Projection=\"";
+    text += WGS84_WKT;
+    text += "\" dataAxisToSRSAxisMapping=\"2,1\">\n";
+    for (size_t i = 0; i < values.refs.size() / 4; i++)
+    {
+        const double *r = &values.refs[4*i];
+        if (r[0] == input_buffer::NAN_D || r[1] == input_buffer::NAN_D ||
+            r[2] == input_buffer::NAN_D || r[3] == input_buffer::NAN_D) continue;
+
+        p = cbuf;
+        memcpy(p, "    <GCP Id=\"", 13);
+        p = put_number(p + 13, (long int) (i + 1));
+        memcpy(p, "\" Pixel=\"", 9);
+        p = put_number(p + 9, (long int) r[0]);
+        memcpy(p, "\" Line=\"", 8);
+        p = put_number(p + 8, (long int) r[1]);
+        memcpy(p, "\" X=\"", 5);
+        p = put_number(p + 5, r[3]);
+        memcpy(p, "\" Y=\"", 5);
+        p = put_number(p + 5, r[2]);
+        memcpy(p, "\"/>\n", 4);
+        text.append(cbuf, p + 4 - cbuf);
+    }
+    text += "  </GCPList>\n</PAMDataset>\n";
+    return true;
+}
+
+// The coverage index file, in the byte order of the machine that wrote it:
+// the file header, the charts, the outline points (lat, lon), the start of
+// every grid cell in the entries plus one for the end, the entries (chart
+// numbers) and the chart names. The parts with doubles come first, so they
+// stay aligned.
+static const unsigned int COVERAGE_VERSION = 1;
+static const unsigned int GRID_ROWS = 180, GRID_COLS = 360;    // cells of one degree
+
+struct coverage_file_header
+{
+    char magic[8];              // "MC2BSBHC"
+    unsigned int version;
+    unsigned int n_charts;
+    unsigned int n_points;
+    unsigned int n_entries;
+    unsigned int names_size;
+    unsigned int n_cells;
+};
+
+struct coverage_index::chart_entry
+{
+    double min_lat, min_lon, max_lat, max_lon;      // max_lon > 180 if across the 180th meridian
+    unsigned int first_point, n_points;
+    unsigned int name_offset, name_length;
+};
+
+// The grid cells a box touches: rows r0..r1 and columns c0..c1, which may
+// run past 360 and are taken modulo 360
+static void grid_cells(double min_lat, double min_lon, double max_lat, double max_lon,
+                       int &r0, int &r1, int &c0, int &c1)
+{
+    r0 = max(0, min((int) GRID_ROWS - 1, (int) floor(min_lat + 90.0)));
+    r1 = max(0, min((int) GRID_ROWS - 1, (int) floor(max_lat + 90.0)));
+    c0 = (int) floor(min_lon + 180.0);
+    c1 = (int) floor(max_lon + 180.0);
+    if (c1 - c0 >= (int) GRID_COLS)
+    {
+        c0 = 0;
+        c1 = GRID_COLS - 1;
+    }
+}
+
+static unsigned int grid_col(int c)
+{
+    return (unsigned int) ((c % (int) GRID_COLS + GRID_COLS) % GRID_COLS);
+}
+
+// Add the PLY outline of a section, with the B<n> points the way they go
+// into the header. False if it has no outline (less than 3 points, or a
+// point without a value).
+bool coverage_builder::add(string_view name, const input_buffer &buf)
+{
+    outline o;
+    char key[16];
+    for (unsigned int cnt = 1; ; cnt++)
+    {
+        string_view sv = buf.field(numbered_key(key, "B", cnt));
+        if (sv.empty())
+            break;
+
+        double lat = to_double(extract_field(sv,0));
+        double lon = to_double(extract_field(sv,1));
+        if (lat == input_buffer::NAN_D || lon == input_buffer::NAN_D) return false;
+        if (lon>180.0) lon=lon-360.0;
+        o.points.push_back(lat);
+        o.points.push_back(lon);
+    }
+    size_t n = o.points.size() / 2;
+    if (n < 3) return false;
+
+    // An outline with a side longer than half the world crosses the 180th
+    // meridian instead, and is kept in longitudes from 0 to 360
+    bool cross_180 = false;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (fabs(o.points[2*i+1] - o.points[2*((i+1)%n)+1]) > 180.0) cross_180 = true;
+    }
+    if (cross_180)
+    {
+        for (size_t i = 0; i < n; i++)
+        {
+            if (o.points[2*i+1] < 0.0) o.points[2*i+1] += 360.0;
+        }
+    }
+
+    o.name = name;
+    o.sequence = outlines.size();
+    outlines.push_back(move(o));
+    return true;
+}
+
+// Write the index file. Of outlines with the same name the last one added
+// is kept, and the charts are put in name order.
+bool coverage_builder::save(const string &filename) const
+{
+    vector<const outline *> sorted;
+    for (size_t u = 0; u < outlines.size(); u++) sorted.push_back(&outlines[u]);
+    sort(sorted.begin(), sorted.end(), [](const outline *a, const outline *b)
+         { return a->name != b->name ? a->name < b->name : a->sequence > b->sequence; });
+    sorted.erase(unique(sorted.begin(), sorted.end(), [](const outline *a, const outline *b)
+                        { return a->name == b->name; }), sorted.end());
+
+    coverage_file_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "MC2BSBHC", 8);
+    h.version = COVERAGE_VERSION;
+    h.n_charts = sorted.size();
+    h.n_cells = GRID_ROWS * GRID_COLS;
+
+    vector<coverage_index::chart_entry> charts(sorted.size());
+    vector<double> points;
+    string names;
+    vector<unsigned int> cells(h.n_cells + 1, 0);
+    for (size_t u = 0; u < sorted.size(); u++)
+    {
+        const outline &o = *sorted[u];
+        coverage_index::chart_entry &c = charts[u];
+        c.first_point = points.size() / 2;
+        c.n_points = o.points.size() / 2;
+        c.name_offset = names.size();
+        c.name_length = o.name.size();
+        names += o.name;
+        points.insert(points.end(), o.points.begin(), o.points.end());
+
+        c.min_lat = c.max_lat = o.points[0];
+        c.min_lon = c.max_lon = o.points[1];
+        for (size_t i = 1; i < c.n_points; i++)
+        {
+            c.min_lat = min(c.min_lat, o.points[2*i]);
+            c.max_lat = max(c.max_lat, o.points[2*i]);
+            c.min_lon = min(c.min_lon, o.points[2*i+1]);
+            c.max_lon = max(c.max_lon, o.points[2*i+1]);
+        }
+
+        int r0, r1, c0, c1;
+        grid_cells(c.min_lat, c.min_lon, c.max_lat, c.max_lon, r0, r1, c0, c1);
+        for (int r = r0; r <= r1; r++)
+            for (int col = c0; col <= c1; col++)
+                cells[r * GRID_COLS + grid_col(col) + 1]++;
+    }
+    for (unsigned int u = 0; u < h.n_cells; u++) cells[u+1] += cells[u];
+
+    vector<unsigned int> entries(cells[h.n_cells]);
+    vector<unsigned int> fill(cells.begin(), cells.end() - 1);
+    for (size_t u = 0; u < charts.size(); u++)
+    {
+        int r0, r1, c0, c1;
+        grid_cells(charts[u].min_lat, charts[u].min_lon, charts[u].max_lat, charts[u].max_lon, r0, r1, c0, c1);
+        for (int r = r0; r <= r1; r++)
+            for (int col = c0; col <= c1; col++)
+                entries[fill[r * GRID_COLS + grid_col(col)]++] = u;
+    }
+    h.n_points = points.size() / 2;
+    h.n_entries = entries.size();
+    h.names_size = names.size();
+
+    string text((const char *) &h, sizeof(h));
+    text.append((const char *) charts.data(), charts.size() * sizeof(charts[0]));
+    text.append((const char *) points.data(), points.size() * sizeof(double));
+    text.append((const char *) cells.data(), cells.size() * sizeof(unsigned int));
+    text.append((const char *) entries.data(), entries.size() * sizeof(unsigned int));
+    text += names;
+    return write_file(filename, text);
+}
+
+// Map an index file. False if it is not one, not of this version, or damaged.
+bool coverage_index::open(const string &filename)
+{
+    n_charts = 0;
+    if (!file.open(filename)) return false;
+
+    string_view text = file.contents();
+    coverage_file_header h;
+    if (text.size() < sizeof(h)) return false;
+    memcpy(&h, text.data(), sizeof(h));
+    if (memcmp(h.magic, "MC2BSBHC", 8) != 0 || h.version != COVERAGE_VERSION ||
+        h.n_cells != GRID_ROWS * GRID_COLS)
+        return false;
+
+    size_t size = sizeof(h) + (size_t) h.n_charts * sizeof(chart_entry) + (size_t) h.n_points * 2 * sizeof(double)
+                + ((size_t) h.n_cells + 1 + h.n_entries) * sizeof(unsigned int) + h.names_size;
+    if (text.size() != size) return false;
+
+    const char *p = text.data() + sizeof(h);
+    charts = (const chart_entry *) p;
+    p += h.n_charts * sizeof(chart_entry);
+    points = (const double *) p;
+    p += h.n_points * 2 * sizeof(double);
+    cells = (const unsigned int *) p;
+    p += (h.n_cells + 1) * sizeof(unsigned int);
+    entries = (const unsigned int *) p;
+    p += h.n_entries * sizeof(unsigned int);
+    names = p;
+
+    // Everything find() follows must stay inside the file, even if it is
+    // damaged or not the index it says it is
+    for (unsigned int u = 0; u < h.n_charts; u++)
+    {
+        const chart_entry &c = charts[u];
+        if (c.n_points < 3 || (size_t) c.first_point + c.n_points > h.n_points ||
+            (size_t) c.name_offset + c.name_length > h.names_size)
+            return false;
+    }
+    if (cells[0] != 0 || cells[h.n_cells] != h.n_entries) return false;
+    for (unsigned int u = 0; u < h.n_cells; u++)
+    {
+        if (cells[u] > cells[u+1]) return false;
+    }
+    for (unsigned int e = 0; e < h.n_entries; e++)
+    {
+        if (entries[e] >= h.n_charts) return false;
+    }
+
+    n_charts = h.n_charts;
+    return true;
+}
+
+string_view coverage_index::name(unsigned int chart) const
+{
+    return string_view(names + charts[chart].name_offset, charts[chart].name_length);
+}
+
+// Is the point inside the outline of a chart (even-odd rule)
+bool coverage_index::contains(unsigned int chart, double lat, double lon) const
+{
+    const chart_entry &c = charts[chart];
+    if (lat < c.min_lat || lat > c.max_lat || lon < c.min_lon || lon > c.max_lon) return false;
+
+    const double *pt = points + 2 * c.first_point;
+    bool inside = false;
+    for (unsigned int i = 0, j = c.n_points - 1; i < c.n_points; j = i++)
+    {
+        double lat_i = pt[2*i], lon_i = pt[2*i+1], lat_j = pt[2*j], lon_j = pt[2*j+1];
+        if ((lat_i > lat) != (lat_j > lat) &&
+            lon < lon_i + (lat - lat_i) * (lon_j - lon_i) / (lat_j - lat_i))
+            inside = !inside;
+    }
+    return inside;
+}
+
+// Does the outline of a chart overlap the box: does a side of it run
+// through the box, or is the box inside it
+bool coverage_index::overlaps(unsigned int chart, double south, double west, double north, double east) const
+{
+    const chart_entry &c = charts[chart];
+    if (north < c.min_lat || south > c.max_lat || east < c.min_lon || west > c.max_lon) return false;
+
+    const double *pt = points + 2 * c.first_point;
+    for (unsigned int i = 0, j = c.n_points - 1; i < c.n_points; j = i++)
+    {
+        // Clip the side to the box (Liang-Barsky)
+        double lat0 = pt[2*j], lon0 = pt[2*j+1];
+        double dlat = pt[2*i] - lat0, dlon = pt[2*i+1] - lon0;
+        double p[4] = { -dlon, dlon, -dlat, dlat };
+        double q[4] = { lon0 - west, east - lon0, lat0 - south, north - lat0 };
+        double t0 = 0.0, t1 = 1.0;
+        bool meets = true;
+        for (unsigned int k = 0; k < 4 && meets; k++)
+        {
+            if (p[k] == 0.0)
+            {
+                if (q[k] < 0.0) meets = false;
+            }
+            else
+            {
+                double t = q[k] / p[k];
+                if (p[k] < 0.0) t0 = max(t0, t);
+                else            t1 = min(t1, t);
+                if (t0 > t1) meets = false;
+            }
+        }
+        if (meets) return true;
+    }
+    return contains(chart, south, west);
+}
+
+// The charts whose outline contains the point, in name order
+void coverage_index::find(double lat, double lon, vector<string_view> &found) const
+{
+    found.clear();
+    if (n_charts == 0 || !isfinite(lat) || !isfinite(lon) || lat < -90.0 || lat > 90.0) return;
+
+    lon = fmod(lon + 180.0, 360.0);
+    if (lon < 0.0) lon += 360.0;
+    lon -= 180.0;
+
+    int r0, r1, c0, c1;
+    grid_cells(lat, lon, lat, lon, r0, r1, c0, c1);
+    unsigned int cell = r0 * GRID_COLS + grid_col(c0);
+    for (unsigned int e = cells[cell]; e < cells[cell+1]; e++)
+    {
+        unsigned int u = entries[e];
+        if (contains(u, lat, lon) || (charts[u].max_lon > 180.0 && contains(u, lat, lon + 360.0)))
+            found.push_back(name(u));
+    }
+}
+
+// The charts whose outline overlaps the box, in name order. A box with
+// west > east runs across the 180th meridian.
+void coverage_index::find(double south, double west, double north, double east, vector<string_view> &found) const
+{
+    found.clear();
+    if (n_charts == 0 || !isfinite(south) || !isfinite(west) || !isfinite(north) || !isfinite(east)) return;
+    if (south > north) swap(south, north);
+
+    bool whole = east - west >= 360.0;
+    west = fmod(west + 180.0, 360.0);
+    if (west < 0.0) west += 360.0;
+    west -= 180.0;
+    east = fmod(east + 180.0, 360.0);
+    if (east < 0.0) east += 360.0;
+    east -= 180.0;
+    if (whole)
+    {
+        west = -180.0;
+        east = 180.0;
+    }
+    else if (east < west)
+    {
+        east += 360.0;
+    }
+
+    static thread_local vector<unsigned int> candidates;
+    candidates.clear();
+    int r0, r1, c0, c1;
+    grid_cells(south, west, north, east, r0, r1, c0, c1);
+    for (int r = r0; r <= r1; r++)
+        for (int col = c0; col <= c1; col++)
+        {
+            unsigned int cell = r * GRID_COLS + grid_col(col);
+            candidates.insert(candidates.end(), entries + cells[cell], entries + cells[cell+1]);
+        }
+    sort(candidates.begin(), candidates.end());
+    candidates.erase(unique(candidates.begin(), candidates.end()), candidates.end());
+
+    // The outlines lie between -180 and 360, the box between -180 and 540
+    for (size_t k = 0; k < candidates.size(); k++)
+    {
+        unsigned int u = candidates[k];
+        if (overlaps(u, south, west, north, east) ||
+            overlaps(u, south, west - 360.0, north, east - 360.0) ||
+            overlaps(u, south, west + 360.0, north, east + 360.0))
+            found.push_back(name(u));
+    }
+}
@@ -68,425 +68,2277 @@ New version 0.0.2 - Rewritten by a real c++ programmer - Henrik Jessen. Totally
 ***************************************************************************
 */
 
-// to compile:  g++ -Wall -s -O2 mc2bsbh.cpp -o mc2bsbh
+// to compile:  make   (builds libmc2bsbh.a and links mc2bsbh with it)
 
-#define VERSION "beta09"
+#include "mc2bsbh.h"
 
 #include <iostream>
-#include <cmath>
 #include <fstream>
 #include <cstdlib>
 #include <cstdio>
-#include <vector>
+#include <cstring>
+#include <memory>
+#include <deque>
+#include <unordered_map>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <algorithm>
+#include <cmath>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <strings.h>
+#include <cerrno>
+#include <csignal>
+#include <poll.h>
+#include <sys/inotify.h>
+#include <fnmatch.h>
+#include <unordered_set>
+#include <ctime>
+#include <charconv>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define VERSION MC2BSBH_VERSION
+
+// More threads than this (-j) only cost memory
+static const unsigned int MAX_THREADS = 256;
 
 using namespace std;
 
+// The charts asked for with -s and -S. Names are looked up in a hash set;
+// names with * ? or [ are glob patterns as well, tried with fnmatch().
+class chart_selection
+{
+private:
+    deque<string> text;                 // the views below point into it
+    unordered_set<string_view> names;
+    vector<const char *> patterns;
+public:
+    void add(const string &name);
+    bool add_file(const string &filename);
+    bool empty() const          { return names.empty(); }
+    bool matches(string_view chart) const;
+};
+
+void chart_selection::add(const string &name)
+{
+    if (name.empty()) return;           // -s "" selects all, as it always did
+
+    text.push_back(name);
+    names.insert(text.back());
+    if (name.find_first_of("*?[") != string::npos)
+    {
+        patterns.push_back(text.back().c_str());
+    }
+}
+
+// Add the names in a file, one per line
+bool chart_selection::add_file(const string &filename)
+{
+    ifstream listFile(filename.c_str());
+    if (!listFile.is_open()) return false;
+
+    string name;
+    while (getline(listFile, name))
+    {
+        string::size_type first = name.find_first_not_of("\r\t ");
+        if (first == string::npos) continue;
+        add(name.substr(first, name.find_last_not_of("\r\t ") + 1 - first));
+    }
+    return !listFile.bad();
+}
+
+// Is the chart selected? Without any -s or -S all charts are.
+bool chart_selection::matches(string_view chart) const
+{
+    if (names.empty() || names.count(chart)) return true;
+    if (patterns.empty()) return false;
+
+    string name(chart);
+    for (unsigned int u = 0; u < patterns.size(); u++)
+    {
+        if (fnmatch(patterns[u], name.c_str(), 0) == 0) return true;
+    }
+    return false;
+}
+
 // The command line options in a combined struct for easy access
 struct command_line_info
 {
     bool debug_on;
     bool list;
-    string sw_single;
+    bool stats;
+    bool stats_json;
+    bool watch;
+    bool use_index;
+    bool polynomials;
+    bool stream_out;
+    string list_format;         // text, tsv or json
+    bool header_files;          // -f: make the .hdr files
+    vector<shared_ptr<output_sink>> sinks;      // -f: the other files to make of each section
+    unsigned int threads;
+    chart_selection sw_single;
     string sw_ext;
     string sw_out_name;
-    string in_filename;
+    string sw_archive;
+    string sw_cache;
+    string sw_out_dir;
+    string sw_coverage;
+    vector<string> queries;     // -q: lat,lon or south,west,north,east, or - for stdin
+    string transform;           // -t: geo (pixel to lat,lon) or pixel (lat,lon to pixel)
+    string sw_points;           // -i: the points to transform, - for stdin
+    string sw_serve;            // --serve: the socket to answer requests for headers on
+    string sw_ask;              // --ask: the socket to send requests to
+    vector<string> in_filenames;
+};
+
+// The name of the header file to create for a section, in the directory
+// out_dir ("" for the current directory, else ending in '/')
+string header_name(const input_buffer &buf, const command_line_info &opt, const string &out_dir)
+{
+    string_view mc_chart_name = section_name(buf);
+    string st;
+
+    if (opt.sw_out_name.empty())
+    {
+        if (opt.sw_ext.empty())
+            st = out_dir + string(mc_chart_name) + ".hdr";
+        else
+            st = out_dir + string(mc_chart_name) + "." + opt.sw_ext;
+    }
+    else
+    {
+         st = opt.sw_out_name;
+    }
+    return st;
+}
+
+// The hash a section's header is remembered under. The options that change
+// the header are part of it, so a header made without them is not unchanged.
+unsigned long long section_hash(const input_buffer &buf, const command_line_info &opt)
+{
+    unsigned long long hash = buf.hash();
+    if (opt.polynomials) hash = fnv_hash("-p", hash);
+    return hash;
+}
+
+// The names of the files of a section: its header, then the file of every
+// sink, named like the header with the extension of the sink instead
+void output_names(const string &header, const command_line_info &opt, vector<string> &names)
+{
+    string::size_type dot = header.find_last_of('.');
+    if (dot == string::npos || (header.find_last_of('/') != string::npos && dot < header.find_last_of('/')))
+        dot = header.length();
+
+    names.resize(opt.sinks.size() + 1);
+    names[0] = header;
+    for (size_t u = 0; u < opt.sinks.size(); u++)
+    {
+        names[u+1].assign(header, 0, dot);
+        names[u+1] += '.';
+        names[u+1] += opt.sinks[u]->extension();
+    }
+}
+
+// Make the files of a section, reading it only once: the header, and the
+// files of the sinks from the values read for the header. A file that the
+// chart has not got enough for is left empty.
+void make_outputs(input_buffer &buf, const command_line_info &opt, vector<string> &texts,
+                  header_counts &counts)
+{
+    static thread_local chart_values values;
+    texts.resize(opt.sinks.size() + 1);
+    convert_header(buf, texts[0], &counts, opt.polynomials, opt.sinks.empty() ? 0 : &values);
+    for (size_t u = 0; u < opt.sinks.size(); u++)
+    {
+        if (!opt.sinks[u]->make(values, texts[u+1])) texts[u+1].clear();
+    }
+}
+
+// Read the list of formats of -f into the options
+static bool set_formats(command_line_info &opt, const string &formats)
+{
+    opt.header_files = false;
+    string::size_type start = 0;
+    while (start <= formats.length())
+    {
+        string::size_type end = formats.find(',', start);
+        if (end == string::npos) end = formats.length();
+        string format = formats.substr(start, end - start);
+        start = end + 1;
+
+        if (format == "hdr")            opt.header_files = true;
+        else if (format == "geojson")   opt.sinks.push_back(make_shared<geojson_sink>());
+        else if (format == "wld")       opt.sinks.push_back(make_shared<world_file_sink>());
+        else if (format == "aux.xml")   opt.sinks.push_back(make_shared<aux_xml_sink>());
+        else
+        {
+            cout<<"Unknown format " << format << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Counters for --stats. They are cheap enough to be kept on every run. The
+// times of the threads of a pipeline, or of a batch, are added up, so they
+// overlap.
+struct run_stats
+{
+    atomic<unsigned long long> files_read;
+    atomic<unsigned long long> lines_read;
+    atomic<unsigned long long> bytes_read;
+    atomic<unsigned long long> sections_seen;
+    atomic<unsigned long long> sections_skipped;    // not the one asked for with -s
+    atomic<unsigned long long> sections_converted;
+    atomic<unsigned long long> sections_unchanged;
+    atomic<unsigned long long> ref_points;
+    atomic<unsigned long long> ply_points;
+    atomic<long long> read_ns;
+    atomic<long long> convert_ns;
+    atomic<long long> write_ns;
+
+    run_stats() : files_read(0), lines_read(0), bytes_read(0), sections_seen(0), sections_skipped(0),
+                  sections_converted(0), sections_unchanged(0), ref_points(0), ply_points(0),
+                  read_ns(0), convert_ns(0), write_ns(0) {}
+
+    void converted(const header_counts &counts)
+    {
+        sections_converted++;
+        ref_points += counts.ref_points;
+        ply_points += counts.ply_points;
+    }
+    void print(ostream &out, bool json, long long total_ns) const;
 };
 
-// Store the input lines in a searchable buffer
-class input_buffer
+static long long now_ns()
+{
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Print the statistics, as text or as a line of JSON
+void run_stats::print(ostream &out, bool json, long long total_ns) const
+{
+    struct rusage usage;
+    long peak_kb = getrusage(RUSAGE_SELF, &usage) == 0 ? usage.ru_maxrss : 0;
+    char cbuf[1024];
+
+    if (json)
+    {
+        snprintf(cbuf, sizeof(cbuf),
+                 "{\"files_read\":%llu,\"lines_read\":%llu,\"bytes_read\":%llu,\"sections_seen\":%llu,"
+                 "\"sections_converted\":%llu,\"sections_unchanged\":%llu,\"sections_skipped\":%llu,"
+                 "\"ref_points\":%llu,\"ply_points\":%llu,\"read_seconds\":%.6f,\"convert_seconds\":%.6f,"
+                 "\"write_seconds\":%.6f,\"total_seconds\":%.6f,\"peak_rss_kb\":%ld}\n",
+                 files_read.load(), lines_read.load(), bytes_read.load(), sections_seen.load(),
+                 sections_converted.load(), sections_unchanged.load(), sections_skipped.load(),
+                 ref_points.load(), ply_points.load(), read_ns.load() / 1e9, convert_ns.load() / 1e9,
+                 write_ns.load() / 1e9, total_ns / 1e9, peak_kb);
+    }
+    else
+    {
+        snprintf(cbuf, sizeof(cbuf),
+                 "Statistics:\n"
+                 "    read     : %llu files, %llu lines, %llu bytes\n"
+                 "    sections : %llu seen, %llu converted, %llu unchanged, %llu skipped\n"
+                 "    points   : %llu REF, %llu PLY\n"
+                 "    time     : read %.3f s, convert %.3f s, write %.3f s, total %.3f s\n"
+                 "    peak RSS : %ld kB\n",
+                 files_read.load(), lines_read.load(), bytes_read.load(),
+                 sections_seen.load(), sections_converted.load(), sections_unchanged.load(),
+                 sections_skipped.load(), ref_points.load(), ply_points.load(),
+                 read_ns.load() / 1e9, convert_ns.load() / 1e9, write_ns.load() / 1e9, total_ns / 1e9,
+                 peak_kb);
+    }
+    out << cbuf << flush;
+}
+
+// Where the headers go: each into its own file, all of them into one
+// uncompressed tar archive (-a), or one after another to stdout (-O), each
+// after a line "mc2bsbh-header <length> <name>" and with a line
+// "mc2bsbh-end <count>" at the end. Output on stdout moves the log to stderr.
+// The outlines of the charts can also be collected for a coverage index (-g).
+// Headers and log messages may come from several threads at once.
+//
+// Header files can be remembered in a cache file (-c) with the hash of the
+// section they were made from. A section that hashes the same as last time
+// is left alone if its header file still has the size and time it was
+// written with.
+class header_output
 {
 private:
-    vector<string> lines;
+    struct cache_entry
+    {
+        unsigned long long section_hash;
+        unsigned long long header_hash;
+        unsigned long long size;
+        long long mtime_sec;
+        long mtime_nsec;
+    };
+
+    int archive_fd;             // -1 when writing files
+    bool framed;                // the headers go to archive_fd with a line in front, not as tar
+    unsigned long long n_framed;
+    time_t archive_time;
+    string entry;               // the archive entry being put together
+    string cache_filename;
+    unordered_map<string, cache_entry> cache;   // by header file name
+    mutex cache_lock;
+    mutex archive_lock;
+    mutex log_lock;
+    mutex coverage_lock;
+
+    void tar_block(const string &name, char type, size_t size);
+    bool write_all(const string &text);
+    bool save_cache();
 public:
-    void reset()                { lines.clear(); }
-    unsigned int count() const  { return lines.size(); }
-    bool empty() const          { return lines.empty(); }
-    input_buffer()              { reset(); }    // Constructor
-
-    void add_line(const string &new_line);
-    bool append_line(const string &append_line);
-    const string line(unsigned int line_number) const;
-    const string field(const string &field_name) const;
-    double field_double(const string &field_name, unsigned int index = 0) const;
-    long int field_long(const string &field_name, unsigned int index = 0) const;
-    string field_string(const string &field_name, unsigned int index) const;
-    
-    static const long int NAN_L;
-    static const double NAN_D;
-};
+    ostream *log;
+    coverage_builder *coverage; // 0 without -g
 
-// We assume that this value will never appear in a valid MapCal file.
-const long int input_buffer::NAN_L = -0x7FFFFFFF;
-const double input_buffer::NAN_D = input_buffer::NAN_L;
+    header_output() : archive_fd(-1), framed(false), n_framed(0), archive_time(0), log(&cout), coverage(0) {}
+    ~header_output()            { close(); }
+
+    bool open_archive(const string &filename);
+    void open_stream();
+    bool open_cache(const string &filename);
+    bool unchanged(const string &filename, unsigned long long section_hash);
+    bool write(const string &filename, const string &text, unsigned long long section_hash = 0);
+    bool close();
+    void message(const string &text);
+    void add_coverage(const string &filename, const input_buffer &buf);
+};
 
-const string extract_field(const string &in_string, unsigned int field_number);
+// Start writing the headers into a tar archive; "-" is stdout
+bool header_output::open_archive(const string &filename)
+{
+    if (filename == "-")
+    {
+        archive_fd = 1;
+        log = &cerr;
+    }
+    else
+    {
+        archive_fd = ::open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    }
+    archive_time = time(0);
+    return archive_fd >= 0;
+}
 
-// Add a line to the buffer
-void input_buffer::add_line(const string &new_line)
+// Start writing the headers to stdout, each after its framing line
+void header_output::open_stream()
 {
-    lines.push_back(new_line);
+    archive_fd = 1;
+    framed = true;
+    log = &cerr;
 }
 
-// Append a line to last line in the buffer
-bool input_buffer::append_line(const string &append_line)
+// Read the cache file, if there is one yet
+bool header_output::open_cache(const string &filename)
 {
-    if (empty()) return false;
-    
-    lines[count()-1] += "\n" + append_line;
+    cache_filename = filename;
+
+    ifstream cacheFile(filename.c_str());
+    if (!cacheFile.is_open()) return true;
+
+    // The hashes of a version 1 cache ran the lines of a section together,
+    // so such a cache is started over
+    string cline;
+    getline(cacheFile, cline);
+    if (cline == "mc2bsbh cache 1") return true;
+    if (cline != "mc2bsbh cache 2") return false;
+
+    while (getline(cacheFile, cline))
+    {
+        cache_entry e;
+        int name_pos = 0;
+        if (sscanf(cline.c_str(), "%llx %llx %llu %lld.%ld %n", &e.section_hash, &e.header_hash,
+                   &e.size, &e.mtime_sec, &e.mtime_nsec, &name_pos) == 5 && name_pos > 0)
+        {
+            cache[cline.substr(name_pos)] = e;
+        }
+    }
     return true;
 }
 
-// Get the line from the buffer with the given line number
-const string input_buffer::line(unsigned int line_number) const
+// Write the cache back for the next run
+bool header_output::save_cache()
+{
+    string text = "mc2bsbh cache 2\n";
+    char cbuf[128];
+
+    for (unordered_map<string, cache_entry>::const_iterator it = cache.begin(); it != cache.end(); ++it)
+    {
+        const cache_entry &e = it->second;
+        snprintf(cbuf, sizeof(cbuf), "%016llx %016llx %llu %lld.%09ld ", e.section_hash, e.header_hash,
+                 e.size, e.mtime_sec, e.mtime_nsec);
+        text += cbuf;
+        text += it->first;
+        text += '\n';
+    }
+    return write_file(cache_filename, text);
+}
+
+// Is the header file still what the section with this hash made of it
+// last time? Only looks at the file, never opens it.
+bool header_output::unchanged(const string &filename, unsigned long long section_hash)
+{
+    if (cache_filename.empty() || archive_fd >= 0) return false;
+
+    cache_entry e;
+    {
+        lock_guard<mutex> guard(cache_lock);
+        unordered_map<string, cache_entry>::const_iterator it = cache.find(filename);
+        if (it == cache.end() || it->second.section_hash != section_hash) return false;
+        e = it->second;
+    }
+
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0 &&
+           (unsigned long long) st.st_size == e.size &&
+           st.st_mtim.tv_sec == e.mtime_sec && st.st_mtim.tv_nsec == e.mtime_nsec;
+}
+
+// Append a ustar header block for an entry of the given size to the entry.
+// Names too long for ustar get a pax extended header in front.
+void header_output::tar_block(const string &name, char type, size_t size)
 {
-    if (line_number < count())
-        return lines[line_number];
+    char block[512];
+    memset(block, 0, sizeof(block));
+
+    string::size_type split = string::npos;
+    if (name.length() > 100)
+    {
+        split = name.find('/', name.length() > 101 ? name.length() - 101 : 0);
+        if (split == 0 || split > 155) split = string::npos;
+    }
+
+    if (name.length() <= 100)
+    {
+        memcpy(block, name.data(), name.length());
+    }
+    else if (split != string::npos)
+    {
+        memcpy(block + 345, name.data(), split);                        // prefix
+        memcpy(block, name.data() + split + 1, name.length() - split - 1);
+    }
     else
-        return "";
+    {
+        // "<length> path=<name>\n", where the length counts its own digits
+        string record = " path=" + name + "\n";
+        string len = to_string(record.length());
+        if (to_string(record.length() + len.length()).length() > len.length())
+            len = to_string(record.length() + len.length() + 1);
+        else
+            len = to_string(record.length() + len.length());
+        record = len + record;
+
+        tar_block("PaxHeader", 'x', record.length());
+        entry += record;
+        entry.append((512 - record.length() % 512) % 512, '\0');
+
+        memcpy(block, name.data(), 100);
+    }
+
+    snprintf(block + 100, 8, "%07o", 0644);                                   // mode
+    snprintf(block + 108, 8, "%07o", 0);                                      // uid
+    snprintf(block + 116, 8, "%07o", 0);                                      // gid
+    snprintf(block + 124, 12, "%011llo", (unsigned long long) size);
+    snprintf(block + 136, 12, "%011llo", (unsigned long long) archive_time);
+    memset(block + 148, ' ', 8);                                              // checksum
+    block[156] = type;
+    memcpy(block + 257, "ustar", 6);
+    memcpy(block + 263, "00", 2);
+
+    unsigned int sum = 0;
+    for (unsigned int u = 0; u < sizeof(block); u++)
+    {
+        sum += (unsigned char) block[u];
+    }
+    snprintf(block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+
+    entry.append(block, sizeof(block));
 }
 
-// Search and return a field from the given field name from the buffer 
-const string input_buffer::field(const string &field_name) const
+bool header_output::write_all(const string &text)
 {
-    unsigned int u = 0;
-    unsigned int len = field_name.length();
-    
-    string result = "";
-    while (u < count())
+    const char *p = text.data();
+    size_t left = text.length();
+    while (left > 0)
+    {
+        ssize_t n = ::write(archive_fd, p, left);
+        if (n < 0) return false;
+        p += n;
+        left -= n;
+    }
+    return true;
+}
+
+// Write a header: to its own file, as one entry of the archive or as one
+// frame on stdout
+bool header_output::write(const string &filename, const string &text, unsigned long long section_hash)
+{
+    if (archive_fd < 0)
     {
-        if (line(u).length() > (len+1) &&
-        	line(u).compare(0, len, field_name) == 0 &&
-            line(u).at(len) == '=')
+        if (!write_file(filename, text)) return false;
+
+        struct stat st;
+        if (!cache_filename.empty() && stat(filename.c_str(), &st) == 0)
         {
-            result = line(u).substr(len+1);
-            return result;
+            cache_entry e = { section_hash, fnv_hash(text), (unsigned long long) st.st_size,
+                              st.st_mtim.tv_sec, st.st_mtim.tv_nsec };
+            lock_guard<mutex> guard(cache_lock);
+            cache[filename] = e;
         }
-        u++;
+        return true;
+    }
+
+    lock_guard<mutex> guard(archive_lock);
+    entry.clear();
+    if (framed)
+    {
+        entry = "mc2bsbh-header " + to_string(text.length()) + " " + filename + "\n";
+        entry += text;
+        n_framed++;
+        return write_all(entry);
     }
-    return "";
+    tar_block(filename, '0', text.length());
+    entry += text;
+    entry.append((512 - text.length() % 512) % 512, '\0');
+
+    return write_all(entry);
 }
 
-// Search field in buffer and convert to double (return NAN_D if undefined).
-double input_buffer::field_double(const string &field_name, unsigned int index) const
+// Finish the archive or the frames, or save the cache, if any
+bool header_output::close()
 {
-    string info = extract_field(field(field_name), index);
-    if (info.empty())
-        return NAN_D;
+    if (archive_fd < 0)
+    {
+        bool ok = cache_filename.empty() || save_cache();
+        cache_filename.clear();
+        return ok;
+    }
+
+    if (framed)
+        entry = "mc2bsbh-end " + to_string(n_framed) + "\n";
     else
-        return strtod(info.c_str(), 0);
+        entry.assign(1024, '\0');      // end of archive
+    bool ok = write_all(entry);
+    if (archive_fd != 1 && ::close(archive_fd) != 0) ok = false;
+    archive_fd = -1;
+    return ok;
+}
+
+// Print a line to the log
+void header_output::message(const string &text)
+{
+    lock_guard<mutex> guard(log_lock);
+    *log << text << endl;
+}
+
+// Add the outline of the section of a header to the coverage index, if any
+void header_output::add_coverage(const string &filename, const input_buffer &buf)
+{
+    if (!coverage) return;
+    lock_guard<mutex> guard(coverage_lock);
+    coverage->add(filename, buf);
+}
+
+// Write a header out and say so
+void write_header(const string &filename, const string &header, unsigned long long section_hash,
+                  header_output &output, run_stats &stats)
+{
+    output.message("Create " + filename);
+    long long start = now_ns();
+    bool ok = output.write(filename, header, section_hash);
+    stats.write_ns += now_ns() - start;
+    if (!ok)
+    {
+        output.message("Could not write file " + filename);
+    }
+}
+
+// Are all files of a section what a section with this hash made of them?
+bool outputs_unchanged(const vector<string> &names, unsigned long long section_hash,
+                       const command_line_info &opt, header_output &output)
+{
+    for (size_t u = opt.header_files ? 0 : 1; u < names.size(); u++)
+    {
+        if (!output.unchanged(names[u], section_hash)) return false;
+    }
+    return true;
+}
+
+// Write the files of a section out and say so, apart from those that are
+// up to date
+void write_outputs(const vector<string> &names, const vector<string> &texts, unsigned long long section_hash,
+                   const command_line_info &opt, header_output &output, run_stats &stats)
+{
+    for (size_t u = opt.header_files ? 0 : 1; u < names.size(); u++)
+    {
+        if (texts[u].empty())
+            output.message("Skip " + names[u] + ", the chart has not got enough points for it");
+        else if (names.size() > 1 && output.unchanged(names[u], section_hash))
+            output.message("Unchanged " + names[u]);
+        else
+            write_header(names[u], texts[u], section_hash, output, stats);
+    }
+}
+
+// Say that the files of a section are up to date
+void report_unchanged(const vector<string> &names, const command_line_info &opt, header_output &output,
+                      run_stats &stats)
+{
+    for (size_t u = opt.header_files ? 0 : 1; u < names.size(); u++)
+    {
+        output.message("Unchanged " + names[u]);
+    }
+    stats.sections_unchanged++;
+}
+
+// Convert a section of a MapCal file. The strings are stored in an input_buffer
+void convert_section(input_buffer &buf, const command_line_info &opt, const string &out_dir,
+                     header_output &output, run_stats &stats)
+{
+    static thread_local vector<string> names, texts;   // reused for every section
+    string st = header_name(buf, opt, out_dir);
+    unsigned long long hash = section_hash(buf, opt);
+    output.add_coverage(st, buf);
+    output_names(st, opt, names);
+
+    if (outputs_unchanged(names, hash, opt, output))
+    {
+        report_unchanged(names, opt, output, stats);
+        return;
+    }
+
+    header_counts counts;
+    long long start = now_ns();
+    make_outputs(buf, opt, texts, counts);
+    stats.convert_ns += now_ns() - start;
+    stats.converted(counts);
+    write_outputs(names, texts, hash, opt, output, stats);
+}
+
+// A queue between two threads that holds at most a fixed number of items.
+// push() waits while the queue is full, pop() while it is empty; after
+// close() pop() returns false once the queue has run dry.
+template <class T>
+class bounded_queue
+{
+private:
+    deque<T> items;
+    size_t capacity;
+    bool closed;
+    mutex lock;
+    condition_variable not_full, not_empty;
+public:
+    bounded_queue(size_t max_items) : capacity(max_items), closed(false) {}
+
+    void push(const T &item)
+    {
+        unique_lock<mutex> guard(lock);
+        while (items.size() >= capacity) not_full.wait(guard);
+        items.push_back(item);
+        not_empty.notify_one();
+    }
+
+    bool pop(T &item)
+    {
+        unique_lock<mutex> guard(lock);
+        while (items.empty() && !closed) not_empty.wait(guard);
+        if (items.empty()) return false;
+        item = items.front();
+        items.pop_front();
+        not_full.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        lock_guard<mutex> guard(lock);
+        closed = true;
+        not_empty.notify_all();
+    }
+};
+
+// Converts sections in three overlapping stages: the caller reads the
+// sections, worker threads (-j) build the headers in memory and a writer
+// thread writes them out in the order the sections came in. So the log
+// and the files are exactly those of a serial run, while reading never
+// waits for the disk. The stages are joined by bounded queues, which caps
+// the number of sections and headers in memory at any time.
+class section_pipeline
+{
+private:
+    struct job
+    {
+        input_buffer buf;
+        vector<string> names;   // the header, then the files of the sinks
+        unsigned long long hash;
+        vector<string> texts;
+        header_counts counts;
+        bool skipped;           // the files are up to date
+        bool done;
+    };
+
+    const command_line_info &opt;
+    string out_dir;
+    header_output &output;
+    run_stats &stats;
+    vector<job> jobs;
+    bounded_queue<job *> free_jobs;
+    bounded_queue<job *> to_convert;
+    bounded_queue<job *> to_write;      // every job in use, in input order
+    vector<thread> workers;
+    thread writer;
+    mutex lock;
+    condition_variable job_done;
+    bool finished;
+
+    void convert_jobs();
+    void write_jobs();
+public:
+    section_pipeline(unsigned int threads, const command_line_info &options, const string &dir,
+                     header_output &out, run_stats &run);
+    ~section_pipeline();
+
+    void convert(input_buffer &buf);
+    void finish();
+};
+
+section_pipeline::section_pipeline(unsigned int threads, const command_line_info &options,
+                                   const string &dir, header_output &out, run_stats &run)
+    : opt(options), out_dir(dir), output(out), stats(run), jobs(16 * threads + 16), free_jobs(jobs.size()),
+      to_convert(jobs.size()), to_write(jobs.size()), finished(false)
+{
+    // The jobs, and the memory in them, are used over and over again
+    for (unsigned int u = 0; u < jobs.size(); u++)
+    {
+        free_jobs.push(&jobs[u]);
+    }
+    for (unsigned int u = 0; u < threads; u++)
+    {
+        workers.push_back(thread(&section_pipeline::convert_jobs, this));
+    }
+    writer = thread(&section_pipeline::write_jobs, this);
+}
+
+section_pipeline::~section_pipeline()
+{
+    finish();
+}
+
+// Worker thread: build headers until there are no more sections
+void section_pipeline::convert_jobs()
+{
+    job *j;
+    while (to_convert.pop(j))
+    {
+        output_names(header_name(j->buf, opt, out_dir), opt, j->names);
+        j->hash = section_hash(j->buf, opt);
+        j->skipped = outputs_unchanged(j->names, j->hash, opt, output);
+        if (!j->skipped)
+        {
+            long long start = now_ns();
+            make_outputs(j->buf, opt, j->texts, j->counts);
+            stats.convert_ns += now_ns() - start;
+        }
+
+        lock_guard<mutex> guard(lock);
+        j->done = true;
+        job_done.notify_all();
+    }
+}
+
+// Writer thread: write the headers out in input order
+void section_pipeline::write_jobs()
+{
+    job *j;
+    while (to_write.pop(j))
+    {
+        {
+            unique_lock<mutex> guard(lock);
+            while (!j->done) job_done.wait(guard);
+        }
+
+        // In input order, so of sections with the same header the last one counts
+        output.add_coverage(j->names[0], j->buf);
+
+        // An earlier section may have written the same files meanwhile
+        if (j->skipped && outputs_unchanged(j->names, j->hash, opt, output))
+        {
+            report_unchanged(j->names, opt, output, stats);
+        }
+        else
+        {
+            if (j->skipped)
+            {
+                long long start = now_ns();
+                make_outputs(j->buf, opt, j->texts, j->counts);
+                stats.convert_ns += now_ns() - start;
+            }
+            stats.converted(j->counts);
+            write_outputs(j->names, j->texts, j->hash, opt, output, stats);
+        }
+
+        j->buf.reset();
+        free_jobs.push(j);
+    }
+}
+
+// Hand a section over to the pipeline; buf is left empty. Waits if the
+// pipeline is full.
+void section_pipeline::convert(input_buffer &buf)
+{
+    job *j = 0;
+    if (!free_jobs.pop(j)) return;      // free_jobs is never closed, so pop() always gives a job
+    swap(j->buf, buf);
+    j->done = false;
+
+    to_write.push(j);
+    to_convert.push(j);
 }
 
-// Search field in buffer and convert to double (return NAN_D if undefined).
-string input_buffer::field_string(const string &field_name, unsigned int index) const
+// Wait until all sections are written and stop the threads
+void section_pipeline::finish()
 {
-    string info = extract_field(field(field_name), index);
-    return info.c_str();
+    if (finished) return;
+    finished = true;
+
+    to_convert.close();
+    for (unsigned int u = 0; u < workers.size(); u++)
+    {
+        workers[u].join();
+    }
+    to_write.close();
+    writer.join();
+}
+
+// Reads a big input text on several threads. The text is cut at section
+// boundaries into chunks, and each chunk is read by a section_reader of
+// its own, a few chunks ahead of the one being handed out. next() hands
+// the sections out in file order and stops at the same error, with the
+// same counts, as a single section_reader over the whole text would.
+class chunked_reader
+{
+public:
+    static const size_t CHUNK_SIZE = 4 << 20;
+private:
+    struct chunk
+    {
+        string_view text;
+        string_view::size_type offset;
+        vector<input_buffer> sections;
+        string error;
+        unsigned long long lines;
+        unsigned long long bytes;   // read up to, from the start of the text
+        bool done;
+    };
+    vector<chunk> chunks;
+    size_t window;              // how many chunks may be read ahead
+    size_t current;             // the chunk being handed out
+    size_t current_section;
+    size_t next_chunk;          // the next chunk to read
+    bool stopping;
+    mutex lock;
+    condition_variable changed;
+    vector<thread> readers;
+    string error_text;
+    unsigned long long nlines;
+    unsigned long long nbytes;
+
+    void read_chunks();
+public:
+    chunked_reader(string_view text, unsigned int threads);
+    ~chunked_reader();
+
+    bool next(input_buffer &buf);
+    const string &error() const             { return error_text; }
+    unsigned long long lines_read() const   { return nlines; }
+    unsigned long long bytes_read() const   { return nbytes; }
+};
+
+chunked_reader::chunked_reader(string_view text, unsigned int threads)
+    : window(2 * threads), current(0), current_section(0), next_chunk(0), stopping(false),
+      nlines(0), nbytes(0)
+{
+    string_view::size_type pos = 0;
+    while (pos < text.length())
+    {
+        string_view::size_type cut = section_reader::boundary(text, pos + CHUNK_SIZE);
+        chunk c;
+        c.text = text.substr(pos, cut - pos);
+        c.offset = pos;
+        c.lines = 0;
+        c.bytes = 0;
+        c.done = false;
+        chunks.push_back(move(c));
+        pos = cut;
+    }
+
+    for (unsigned int u = 0; u < threads; u++)
+    {
+        readers.push_back(thread(&chunked_reader::read_chunks, this));
+    }
+}
+
+chunked_reader::~chunked_reader()
+{
+    {
+        lock_guard<mutex> guard(lock);
+        stopping = true;
+    }
+    changed.notify_all();
+    for (unsigned int u = 0; u < readers.size(); u++)
+    {
+        readers[u].join();
+    }
+}
+
+// Reader thread: read the next chunk into sections, while it is not too far
+// ahead
+void chunked_reader::read_chunks()
+{
+    for (;;)
+    {
+        size_t c;
+        {
+            unique_lock<mutex> guard(lock);
+            while (!stopping && next_chunk < chunks.size() && next_chunk >= current + window)
+                changed.wait(guard);
+            if (stopping || next_chunk >= chunks.size()) return;
+            c = next_chunk++;
+        }
+
+        chunk &k = chunks[c];
+        section_reader reader(k.text);
+        vector<input_buffer> sections;
+        sections.emplace_back();
+        while (reader.next(sections.back()))
+        {
+            sections.emplace_back();
+        }
+        sections.pop_back();
+
+        lock_guard<mutex> guard(lock);
+        k.sections = move(sections);
+        k.error = reader.error();
+        // A chunk before the last ends with a line break, after which its
+        // reader sees one more (empty) line than the whole text has there
+        k.lines = reader.lines_read() - (k.error.empty() && c + 1 < chunks.size() ? 1 : 0);
+        k.bytes = k.offset + reader.bytes_read();
+        k.done = true;
+        changed.notify_all();
+    }
+}
+
+// Swap the next section into buf. False at the end of the text, or at the
+// first error.
+bool chunked_reader::next(input_buffer &buf)
+{
+    unique_lock<mutex> guard(lock);
+    while (current < chunks.size())
+    {
+        chunk &k = chunks[current];
+        while (!k.done) changed.wait(guard);
+
+        if (current_section < k.sections.size())
+        {
+            swap(buf, k.sections[current_section++]);
+            return true;
+        }
+
+        nlines += k.lines;
+        nbytes = k.bytes;
+        vector<input_buffer>().swap(k.sections);
+        current_section = 0;
+        if (!k.error.empty())
+        {
+            error_text = k.error;
+            current = chunks.size();
+            stopping = true;
+        }
+        else
+        {
+            current++;
+        }
+        changed.notify_all();
+    }
+    return false;
+}
+
+// Convert all sections of an opened input file, putting the headers into
+// out_dir. The sections are converted on a pipeline of the given number of
+// threads, or one after the other if that is 0. Returns false, with the
+// reason in error, for a file that is not a calibration file.
+// A big file on more than one thread is also read on that many threads.
+bool convert_file(mapped_file &inFile, const string &out_dir, unsigned int threads,
+                  const command_line_info &opt, header_output &output, run_stats &stats,
+                  string &error)
+{
+    input_buffer inp;
+    string_view chart_name;
+
+    unique_ptr<section_pipeline> pipeline;
+    if (threads > 0)
+    {
+        pipeline.reset(new section_pipeline(threads, opt, out_dir, output, stats));
+    }
+
+    section_reader reader(inFile.contents());
+    if (opt.debug_on)
+    {
+        reader.set_trace(output.log);
+    }
+    unique_ptr<chunked_reader> chunked;
+    if (threads > 1 && !opt.debug_on && inFile.contents().size() >= 2 * chunked_reader::CHUNK_SIZE)
+    {
+        chunked.reset(new chunked_reader(inFile.contents(), threads));
+    }
+
+    // Read the whole file, a section at a time
+    long long read_start = now_ns();
+    while (chunked ? chunked->next(inp) : reader.next(inp))
+    {
+        stats.read_ns += now_ns() - read_start;
+        stats.sections_seen++;
+        chart_name = ::chart_name(inp);
+        if (opt.list)
+        {
+            cout.width(15);
+            cout << left << chart_name;
+            cout << inp.field("NA") << endl;
+        }
+        else if (opt.sw_single.matches(chart_name))
+        {
+            if (pipeline) pipeline->convert(inp);
+            else          convert_section(inp, opt, out_dir, output, stats);
+        }
+        else
+        {
+            stats.sections_skipped++;
+        }
+        inp.reset();
+        read_start = now_ns();
+    }
+    stats.read_ns += now_ns() - read_start;
+    stats.files_read++;
+    stats.lines_read += chunked ? chunked->lines_read() : reader.lines_read();
+    stats.bytes_read += chunked ? chunked->bytes_read() : reader.bytes_read();
+
+    if (pipeline) pipeline->finish();
+
+    error = chunked ? chunked->error() : reader.error();
+    return error.empty();
+}
+
+// The sidecar index of an input file (-x), <infile>.idx: the byte range,
+// chart name and title (NA) of every section, so that -s and -l need not
+// parse the whole file. It holds the size and time of the file it was made
+// from, and is made again when they change.
+class section_index
+{
+public:
+    struct entry
+    {
+        unsigned long long offset;
+        unsigned long long length;
+        string chart;
+        string title;
+    };
+    vector<entry> entries;
+
+    bool load(const string &filename, const struct stat &input);
+    bool build(string_view text);
+    bool save(const string &filename, const struct stat &input) const;
+};
+
+// Index fields are separated by tabs; tabs, line breaks and backslashes in
+// the names are escaped
+static void escape_field(string &out, string_view field)
+{
+    for (string_view::size_type u = 0; u < field.length(); u++)
+    {
+        if (field[u] == '\\')      out += "\\\\";
+        else if (field[u] == '\t') out += "\\t";
+        else if (field[u] == '\n') out += "\\n";
+        else                       out += field[u];
+    }
+}
+
+static string unescape_field(string_view field)
+{
+    string out;
+    for (string_view::size_type u = 0; u < field.length(); u++)
+    {
+        if (field[u] == '\\' && u+1 < field.length())
+        {
+            u++;
+            out += field[u] == 't' ? '\t' : field[u] == 'n' ? '\n' : field[u];
+        }
+        else
+        {
+            out += field[u];
+        }
+    }
+    return out;
+}
+
+static string index_stamp(const struct stat &input)
+{
+    char cbuf[96];
+    snprintf(cbuf, sizeof(cbuf), "mc2bsbh index 1 %llu %lld.%09ld", (unsigned long long) input.st_size,
+             (long long) input.st_mtim.tv_sec, (long) input.st_mtim.tv_nsec);
+    return cbuf;
+}
+
+// Read the index, if it is there and made from the input as it is now
+bool section_index::load(const string &filename, const struct stat &input)
+{
+    entries.clear();
+
+    ifstream indexFile(filename.c_str());
+    if (!indexFile.is_open()) return false;
+
+    string iline;
+    getline(indexFile, iline);
+    if (iline != index_stamp(input)) return false;
+
+    while (getline(indexFile, iline))
+    {
+        entry e;
+        string::size_type t1 = iline.find('\t');
+        string::size_type t2 = t1 == string::npos ? t1 : iline.find('\t', t1+1);
+        string::size_type t3 = t2 == string::npos ? t2 : iline.find('\t', t2+1);
+        unsigned long long size = input.st_size;
+        if (t3 == string::npos || sscanf(iline.c_str(), "%llu %llu", &e.offset, &e.length) != 2 ||
+            e.offset > size || e.length > size - e.offset)     // not offset + length, which can wrap
+        {
+            entries.clear();
+            return false;
+        }
+        e.chart = unescape_field(string_view(iline).substr(t2+1, t3-t2-1));
+        e.title = unescape_field(string_view(iline).substr(t3+1));
+        entries.push_back(e);
+    }
+    return true;
+}
+
+// Make the index from the text of the input
+bool section_index::build(string_view text)
+{
+    entries.clear();
+
+    section_reader reader(text);
+    input_buffer inp;
+    while (reader.next(inp))
+    {
+        entry e = { reader.section_offset(), reader.section_length(),
+                    string(chart_name(inp)), string(inp.field("NA")) };
+        entries.push_back(e);
+    }
+    return reader.error().empty();
+}
+
+bool section_index::save(const string &filename, const struct stat &input) const
+{
+    string text = index_stamp(input) + "\n";
+    char cbuf[64];
+
+    for (unsigned int u = 0; u < entries.size(); u++)
+    {
+        const entry &e = entries[u];
+        snprintf(cbuf, sizeof(cbuf), "%llu\t%llu\t", e.offset, e.length);
+        text += cbuf;
+        escape_field(text, e.chart);
+        text += '\t';
+        escape_field(text, e.title);
+        text += '\n';
+    }
+    return write_file(filename, text);
+}
+
+// Do -l or -s from the index of the input file, making the index first if
+// needed. Returns false if that can't be done, and the file must be read
+// the usual way.
+bool convert_indexed(mapped_file &inFile, const string &in_filename, const string &out_dir,
+                     const command_line_info &opt, header_output &output, run_stats &stats)
+{
+    struct stat st;
+    if (stat(in_filename.c_str(), &st) != 0) return false;
+
+    string_view text = inFile.contents();
+    string index_filename = in_filename + ".idx";
+    section_index index;
+    if (!index.load(index_filename, st))
+    {
+        if (!index.build(text)) return false;
+        index.save(index_filename, st);         // no index next time is no harm
+        stats.lines_read += count(text.begin(), text.end(), '\n');
+        stats.bytes_read += text.length();
+    }
+    stats.files_read++;
+
+    long long read_start = now_ns();
+    for (unsigned int u = 0; u < index.entries.size(); u++)
+    {
+        const section_index::entry &e = index.entries[u];
+        stats.sections_seen++;
+        if (opt.list)
+        {
+            cout.width(15);
+            cout << left << e.chart;
+            cout << e.title << '\n';
+        }
+        else if (!opt.sw_single.empty() && opt.sw_single.matches(e.chart))
+        {
+            // Just this section is read
+            input_buffer inp;
+            section_reader reader(text.substr(e.offset, e.length));
+            bool ok = reader.next(inp) && chart_name(inp) == e.chart;
+            stats.read_ns += now_ns() - read_start;
+            stats.lines_read += reader.lines_read();
+            stats.bytes_read += reader.bytes_read();
+            if (!ok) return false;
+
+            convert_section(inp, opt, out_dir, output, stats);
+            read_start = now_ns();
+        }
+        else
+        {
+            stats.sections_skipped++;
+        }
+    }
+    stats.read_ns += now_ns() - read_start;
+    return true;
+}
+
+// List the charts of a file (-l) with a section_scanner, which only looks
+// at the fields it shows
+bool list_file(mapped_file &inFile, const string &in_filename, const command_line_info &opt,
+               run_stats &stats, string &error)
+{
+    section_scanner scanner(inFile.contents());
+    section_summary summary;
+    string line;
+    char cbuf[64];
+
+    long long start = now_ns();
+    while (scanner.next(summary))
+    {
+        stats.sections_seen++;
+        if (opt.list_format == "text")
+        {
+            cout.width(15);
+            cout << left << summary.chart;
+            cout << summary.title << '\n';
+            continue;
+        }
+
+        // The scale like the header has it, or nothing if there is none
+        string scale;
+        if (!summary.scale.empty())
+        {
+            scale = to_string((long int) strtod(string(summary.scale).c_str(), 0));
+        }
+
+        line.clear();
+        if (opt.list_format == "tsv")
+        {
+            escape_field(line, in_filename);
+            line += '\t';
+            escape_field(line, summary.chart);
+            line += '\t';
+            escape_field(line, summary.title);
+            snprintf(cbuf, sizeof(cbuf), "\t%s\t%u\t%u\n", scale.c_str(), summary.ref_points, summary.ply_points);
+            line += cbuf;
+        }
+        else
+        {
+            line += "{\"file\":";
+            json_string(line, in_filename);
+            line += ",\"chart\":";
+            json_string(line, summary.chart);
+            line += ",\"title\":";
+            json_string(line, summary.title);
+            snprintf(cbuf, sizeof(cbuf), ",\"scale\":%s,\"ref_points\":%u,\"ply_points\":%u}\n",
+                     scale.empty() ? "null" : scale.c_str(), summary.ref_points, summary.ply_points);
+            line += cbuf;
+        }
+        cout << line;
+    }
+    stats.read_ns += now_ns() - start;
+    stats.files_read++;
+    stats.lines_read += scanner.lines_read();
+    stats.bytes_read += scanner.bytes_read();
+
+    error = scanner.error();
+    return error.empty();
+}
+
+// Convert or list an opened input file, in the quickest way the options
+// allow: from its index (-x), with the scanner (-l) or section by section
+bool process_file(mapped_file &inFile, const string &in_filename, const string &out_dir,
+                  unsigned int threads, const command_line_info &opt, header_output &output,
+                  run_stats &stats, string &error)
+{
+    if (opt.debug_on)
+    {
+        return convert_file(inFile, out_dir, threads, opt, output, stats, error);
+    }
+    if (opt.use_index && in_filename != "-" &&
+        (opt.list ? opt.list_format == "text" : !opt.sw_single.empty()) &&
+        convert_indexed(inFile, in_filename, out_dir, opt, output, stats))
+    {
+        return true;
+    }
+    if (opt.list)
+    {
+        return list_file(inFile, in_filename, opt, stats, error);
+    }
+    return convert_file(inFile, out_dir, threads, opt, output, stats, error);
+}
+
+// Runs a job for each of a number of items on a pool of threads. Every
+// thread has its own queue of items and works from its front; a thread
+// whose queue has run dry steals from the back of the others, so a big
+// item only ever holds up the thread that took it. The items are dealt
+// out in turn, so the biggest should come first.
+class work_pool
+{
+private:
+    struct work_queue
+    {
+        mutex lock;
+        deque<size_t> items;
+    };
+    vector<unique_ptr<work_queue>> queues;
+    function<void(size_t)> job;
+
+    bool next(unsigned int worker, size_t &item);
+    void work(unsigned int worker);
+public:
+    work_pool(unsigned int threads, size_t n_items);
+
+    void run(const function<void(size_t)> &item_job);
+};
+
+work_pool::work_pool(unsigned int threads, size_t n_items)
+{
+    if (threads > n_items) threads = n_items;
+    if (threads == 0) threads = 1;
+
+    for (unsigned int u = 0; u < threads; u++)
+    {
+        queues.push_back(unique_ptr<work_queue>(new work_queue));
+    }
+    for (size_t i = 0; i < n_items; i++)
+    {
+        queues[i % threads]->items.push_back(i);
+    }
+}
+
+// The next item for a thread: its own, or one stolen from another thread
+bool work_pool::next(unsigned int worker, size_t &item)
+{
+    {
+        work_queue &own = *queues[worker];
+        lock_guard<mutex> guard(own.lock);
+        if (!own.items.empty())
+        {
+            item = own.items.front();
+            own.items.pop_front();
+            return true;
+        }
+    }
+    for (unsigned int u = 1; u < queues.size(); u++)
+    {
+        work_queue &victim = *queues[(worker + u) % queues.size()];
+        lock_guard<mutex> guard(victim.lock);
+        if (!victim.items.empty())
+        {
+            item = victim.items.back();
+            victim.items.pop_back();
+            return true;
+        }
+    }
+    return false;
+}
+
+void work_pool::work(unsigned int worker)
+{
+    size_t item;
+    while (next(worker, item))
+    {
+        job(item);
+    }
+}
+
+// Run the job on all items and wait until they are done
+void work_pool::run(const function<void(size_t)> &item_job)
+{
+    job = item_job;
+
+    vector<thread> threads;
+    for (unsigned int u = 1; u < queues.size(); u++)
+    {
+        threads.push_back(thread(&work_pool::work, this, u));
+    }
+    work(0);
+    for (unsigned int u = 0; u < threads.size(); u++)
+    {
+        threads[u].join();
+    }
+}
+
+// An input file of a batch and the directory its headers go to
+struct input_file
+{
+    string name;
+    string out_dir;
+    off_t size;
+};
+
+// Is this the name of a MapCal file (*.dir, in any case)?
+static bool is_calibration_name(const string &name)
+{
+    return name.length() > 4 && strcasecmp(name.c_str() + name.length() - 4, ".dir") == 0;
+}
+
+// The directory part of a path, with its '/', or "" if there is none
+static string directory_of(const string &path)
+{
+    string::size_type slash = path.find_last_of('/');
+    return slash == string::npos ? string() : path.substr(0, slash+1);
+}
+
+// Collect the MapCal files below a directory, in name order. Their headers
+// go next to them, or, with -D, into the same subdirectory of out_dir.
+static void find_inputs(const string &dir, const string &out_dir, const command_line_info &opt,
+                        vector<input_file> &files)
+{
+    DIR *d = opendir(dir.c_str());
+    if (!d) return;
+
+    vector<string> names;
+    while (struct dirent *e = readdir(d))
+    {
+        string name = e->d_name;
+        if (name != "." && name != "..") names.push_back(name);
+    }
+    closedir(d);
+    sort(names.begin(), names.end());
+
+    for (unsigned int u = 0; u < names.size(); u++)
+    {
+        string path = dir + "/" + names[u];
+        struct stat st;
+        if (lstat(path.c_str(), &st) != 0) continue;
+
+        if (S_ISDIR(st.st_mode))            // symbolic links to directories are not followed
+        {
+            find_inputs(path, opt.sw_out_dir.empty() ? path + "/" : out_dir + names[u] + "/", opt, files);
+        }
+        else if (is_calibration_name(names[u]) && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+        {
+            input_file f = { path, out_dir, st.st_size };
+            files.push_back(f);
+        }
+    }
+}
+
+// Create a directory and the ones above it, if they are not there yet
+static bool make_dirs(const string &path)
+{
+    for (string::size_type slash = path.find('/', 1); ; slash = path.find('/', slash+1))
+    {
+        string dir = path.substr(0, slash);
+        if (!dir.empty() && mkdir(dir.c_str(), 0777) != 0 && errno != EEXIST) return false;
+        if (slash == string::npos) break;
+    }
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// --watch: after the first run, wait for the input files to be written and
+// convert them again, but only the sections that changed. Every file keeps
+// the hash of the section each of its headers was made from; a header whose
+// section is gone is removed. The directories of the files are watched, so
+// a file that is replaced by a rename is seen too.
+class file_watcher
+{
+private:
+    struct watched_file
+    {
+        string name;
+        string out_dir;
+        string base;            // the name in its directory, as inotify gives it
+        int wd;
+        unordered_map<string, unsigned long long> headers;  // header name -> section hash
+    };
+
+    const command_line_info &opt;
+    header_output &output;
+    run_stats &stats;
+    vector<watched_file> files;
+    vector<input_buffer> sections;      // of the file being updated; reused
+    int fd;
+
+    bool update(watched_file &f, bool convert);
+public:
+    file_watcher(const command_line_info &options, header_output &out, run_stats &run)
+        : opt(options), output(out), stats(run), fd(inotify_init1(IN_CLOEXEC)) {}
+    ~file_watcher()             { if (fd >= 0) ::close(fd); }
+
+    bool add(const string &filename, const string &out_dir);
+    bool run(volatile sig_atomic_t &stop);
+    size_t count() const        { return files.size(); }
+};
+
+// Start watching a file; what is in it now is taken to be converted already
+bool file_watcher::add(const string &filename, const string &out_dir)
+{
+    watched_file f;
+    string dir = directory_of(filename);
+    f.name = filename;
+    f.out_dir = out_dir;
+    f.base = filename.substr(dir.length());
+    f.wd = fd < 0 ? -1 : inotify_add_watch(fd, dir.empty() ? "." : dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO);
+    if (f.wd < 0) return false;
+
+    update(f, false);
+    files.push_back(f);
+    return true;
+}
+
+// Read a file again and convert the sections whose hash has changed. The
+// header of a name is made by the last section with that name, as in a
+// full run.
+bool file_watcher::update(watched_file &f, bool convert)
+{
+    mapped_file inFile;
+    if (!inFile.open(f.name))
+    {
+        if (convert) output.message("Could not open file " + f.name);
+        return false;
+    }
+
+    section_reader reader(inFile.contents());
+    size_t n = 0;
+    for (;;)
+    {
+        if (sections.size() <= n) sections.emplace_back();
+        if (!reader.next(sections[n])) break;
+        n++;
+    }
+    if (!reader.error().empty())
+    {
+        if (convert) output.message(reader.error() + ": " + f.name);
+        return false;
+    }
+
+    vector<string> names(n);
+    unordered_map<string, size_t> last;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (!opt.sw_single.matches(chart_name(sections[i]))) continue;
+        names[i] = header_name(sections[i], opt, f.out_dir);
+        last[names[i]] = i;
+    }
+
+    unordered_map<string, unsigned long long> now;
+    for (size_t i = 0; i < n; i++)
+    {
+        if (names[i].empty() || last[names[i]] != i) continue;
+
+        unsigned long long hash = section_hash(sections[i], opt);
+        now[names[i]] = hash;
+
+        unordered_map<string, unsigned long long>::const_iterator old = f.headers.find(names[i]);
+        if (convert && (old == f.headers.end() || old->second != hash))
+        {
+            convert_section(sections[i], opt, f.out_dir, output, stats);
+        }
+    }
+
+    if (convert)
+    {
+        vector<string> removed;
+        for (unordered_map<string, unsigned long long>::const_iterator it = f.headers.begin();
+             it != f.headers.end(); ++it)
+        {
+            if (now.count(it->first)) continue;
+            output_names(it->first, opt, removed);
+            for (size_t u = opt.header_files ? 0 : 1; u < removed.size(); u++)
+            {
+                if (unlink(removed[u].c_str()) == 0)
+                    output.message("Remove " + removed[u]);
+                else if (errno != ENOENT)
+                    output.message("Could not remove file " + removed[u]);
+            }
+        }
+    }
+
+    f.headers.swap(now);
+    return true;
+}
+
+// Wait for changes until stop is set (by a signal)
+bool file_watcher::run(volatile sig_atomic_t &stop)
+{
+    alignas(struct inotify_event) char events[4096];
+    vector<bool> changed(files.size());
+
+    while (!stop)
+    {
+        // A program saving a file may take a few writes; wait until it is quiet
+        int timeout = -1;
+        for (;;)
+        {
+            struct pollfd p = { fd, POLLIN, 0 };
+            int r = poll(&p, 1, timeout);
+            if (r < 0 && errno != EINTR) return false;
+            if (r <= 0) break;
+
+            ssize_t len = ::read(fd, events, sizeof(events));
+            if (len <= 0) return false;
+            for (char *e = events; e < events + len; e += sizeof(struct inotify_event) + ((struct inotify_event *) e)->len)
+            {
+                const struct inotify_event *event = (const struct inotify_event *) e;
+                if (event->len == 0) continue;
+                for (unsigned int u = 0; u < files.size(); u++)
+                {
+                    if (files[u].wd == event->wd && files[u].base == event->name) changed[u] = true;
+                }
+            }
+            timeout = 20;
+        }
+
+        for (unsigned int u = 0; u < files.size(); u++)
+        {
+            if (!changed[u]) continue;
+            changed[u] = false;
+            update(files[u], true);
+        }
+    }
+    return true;
+}
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void stop_watching(int)
+{
+    stop_requested = 1;
+}
+
+// Parse a -q query: lat,lon or south,west,north,east
+static bool parse_query(const string &query, vector<double> &values)
+{
+    values.clear();
+    const char *p = query.c_str();
+    for (;;)
+    {
+        char *end;
+        double v = strtod(p, &end);
+        if (end == p || !isfinite(v)) return false;     // nan and inf read as numbers too
+        values.push_back(v);
+        while (*end == ' ' || *end == '\t' || *end == '\r') end++;
+        if (*end == 0) break;
+        if (*end != ',') return false;
+        p = end + 1;
+    }
+    return values.size() == 2 || values.size() == 4;
+}
+
+// Answer the -q queries from the coverage index: a line for each, with the
+// charts found separated by tabs. "-" reads a query per line from stdin.
+static int run_queries(const command_line_info &opt)
+{
+    coverage_index index;
+    if (opt.sw_coverage.empty())
+    {
+        cout<<"-q needs a coverage index (-g indexfile)"<<endl;
+        return 1;
+    }
+    if (!index.open(opt.sw_coverage))
+    {
+        cout<<"Could not read coverage index " << opt.sw_coverage << endl;
+        return 1;
+    }
+
+    vector<double> values;
+    vector<string_view> found;
+    string out, query;
+    int result = 0;
+    for (unsigned int u = 0; u < opt.queries.size(); u++)
+    {
+        bool from_stdin = opt.queries[u] == "-";
+        query = opt.queries[u];
+        while (from_stdin ? (bool) getline(cin, query) : !query.empty())
+        {
+            out.clear();
+            if (!parse_query(query, values))
+            {
+                cerr<<"Bad query " << query << endl;
+                result = 1;
+            }
+            else
+            {
+                if (values.size() == 2) index.find(values[0], values[1], found);
+                else                    index.find(values[0], values[1], values[2], values[3], found);
+                for (size_t k = 0; k < found.size(); k++)
+                {
+                    if (k > 0) out += '\t';
+                    out += found[k];
+                }
+            }
+            out += '\n';
+            cout << out;
+            if (!from_stdin) break;
+        }
+    }
+    cout << flush;
+    return result;
+}
+
+// Read a point "a,b" of -t; blanks around the numbers are allowed
+static bool parse_point(string_view line, double &a, double &b)
+{
+    const char *p = line.data(), *end = p + line.length();
+    while (end > p && (end[-1] == '\r' || end[-1] == ' ' || end[-1] == '\t')) end--;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    from_chars_result r = from_chars(p, end, a);
+    if (r.ec != errc()) return false;
+    p = r.ptr;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    if (p == end || *p != ',') return false;
+    p++;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    r = from_chars(p, end, b);
+    return r.ec == errc() && r.ptr == end;
+}
+
+// Transform points with the calibration of the chart asked for with -s: a
+// line "x,y" to "lat,lon" (-t geo) or "lat,lon" to "x,y" (-t pixel), with
+// the polynomials -p writes into its header. The points are read and
+// transformed in batches; a bad line gives an empty line.
+static int run_transform(mapped_file &inFile, const command_line_info &opt)
+{
+    section_reader reader(inFile.contents());
+    input_buffer buf;
+    bool found = false;
+    while (!found && reader.next(buf))
+    {
+        found = opt.sw_single.matches(chart_name(buf));
+    }
+    if (!reader.error().empty())
+    {
+        cout<<reader.error()<<endl;
+        return 1;
+    }
+    if (!found)
+    {
+        cout<<"Chart not found"<<endl;
+        return 1;
+    }
+
+    chart_transform transform;
+    if (!transform.fit(buf))
+    {
+        cout<<"Chart " << chart_name(buf) << " needs at least 3 REF points, not all in a line, to transform with"<<endl;
+        return 1;
+    }
+
+    ifstream pointsFile;
+    if (!opt.sw_points.empty() && opt.sw_points != "-")
+    {
+        pointsFile.open(opt.sw_points.c_str());
+        if (!pointsFile.is_open())
+        {
+            cout<<"Could not open file " << opt.sw_points << endl;
+            return 1;
+        }
+    }
+    istream &in = pointsFile.is_open() ? pointsFile : cin;
+    ios::sync_with_stdio(false);
+
+    // The points of a batch, a coordinate per array
+    const size_t BATCH = 4096;
+    vector<double> in_a(BATCH), in_b(BATCH), out_a(BATCH), out_b(BATCH);
+    vector<unsigned char> good(BATCH);
+    bool to_geo = opt.transform == "geo";
+    string line, out;
+    int result = 0;
+    while (in)
+    {
+        size_t n = 0;
+        while (n < BATCH && getline(in, line))
+        {
+            good[n] = parse_point(line, in_a[n], in_b[n]);
+            if (!good[n])
+            {
+                cerr<<"Bad point " << line << endl;
+                in_a[n] = in_b[n] = 0.0;
+                result = 1;
+            }
+            n++;
+        }
+
+        if (to_geo) transform.to_geo(n, in_a.data(), in_b.data(), out_a.data(), out_b.data());
+        else        transform.to_pixel(n, in_a.data(), in_b.data(), out_a.data(), out_b.data());
+
+        out.clear();
+        char cbuf[80];
+        for (size_t i = 0; i < n; i++)
+        {
+            if (good[i])
+            {
+                char *p = to_chars(cbuf, cbuf + 32, out_a[i]).ptr;
+                *p++ = ',';
+                p = to_chars(p, p + 32, out_b[i]).ptr;
+                out.append(cbuf, p - cbuf);
+            }
+            out += '\n';
+        }
+        cout << out;
+    }
+    cout << flush;
+    return result;
+}
+
+// The charts of the input file of --serve, read once. A header is converted
+// the first time it is asked for and then kept. A reload reads the file into
+// a new set; the old one goes when the last client still using it is done.
+struct served_charts
+{
+    mapped_file file;
+    vector<input_buffer> sections;
+    vector<string> names;                       // of the charts served, in file order
+    unordered_map<string, size_t> by_name;      // chart name -> its last section
+    unique_ptr<string[]> headers;
+    unique_ptr<once_flag[]> converted;
+
+    bool load(const string &filename, const command_line_info &opt, string &error);
+    const string *header(const string &name, bool polynomials);
+};
+
+// Read the input file and keep the sections of the charts that -s and -S
+// select. A big file is read on -j threads, as for converting it.
+bool served_charts::load(const string &filename, const command_line_info &opt, string &error)
+{
+    if (!file.open(filename))
+    {
+        error = "Could not open file " + filename;
+        return false;
+    }
+
+    section_reader reader(file.contents());
+    unique_ptr<chunked_reader> chunked;
+    if (opt.threads > 1 && file.contents().size() >= 2 * chunked_reader::CHUNK_SIZE)
+    {
+        chunked.reset(new chunked_reader(file.contents(), opt.threads));
+    }
+
+    sections.emplace_back();
+    while (chunked ? chunked->next(sections.back()) : reader.next(sections.back()))
+    {
+        string name(chart_name(sections.back()));
+        if (name.empty() || !opt.sw_single.matches(name))
+        {
+            sections.back().reset();
+            continue;
+        }
+        pair<unordered_map<string, size_t>::iterator, bool> added = by_name.insert(make_pair(name, sections.size() - 1));
+        if (added.second) names.push_back(name);
+        else              added.first->second = sections.size() - 1;
+        sections.emplace_back();
+    }
+    sections.pop_back();
+
+    error = chunked ? chunked->error() : reader.error();
+    if (!error.empty())
+    {
+        error += ": " + filename;
+        return false;
+    }
+    headers.reset(new string[sections.size()]);
+    converted.reset(new once_flag[sections.size()]);
+    return true;
+}
+
+// The header of a chart, or 0 if there is no such chart. Different charts
+// are converted at the same time; a chart asked for by several clients at
+// once is converted by one of them while the others wait.
+const string *served_charts::header(const string &name, bool polynomials)
+{
+    unordered_map<string, size_t>::const_iterator it = by_name.find(name);
+    if (it == by_name.end()) return 0;
+
+    size_t i = it->second;
+    call_once(converted[i], [&]() { convert_header(sections[i], headers[i], 0, polynomials); });
+    return &headers[i];
+}
+
+// --serve: answer requests for headers on a local (Unix) socket, from the
+// charts of the input file read once. A request is a line:
+//   get <chart>    the header of the chart, named like for -s
+//   list           the names of the charts, a line each
+//   reload         read the input file again
+// and its reply is a line "ok <length>" and that many bytes, or a line
+// "error <reason>". A client may send any number of requests on its
+// connection; every connection is served by a thread of its own.
+class header_server
+{
+private:
+    const command_line_info &opt;
+    string in_filename;
+    string socket_name;
+    header_output &output;      // for the log
+    shared_ptr<served_charts> charts;
+    mutex charts_lock;          // for the pointer only
+    mutex reload_lock;          // one reload at a time
+    int listen_fd;
+    unordered_set<int> clients; // connections being served
+    mutex clients_lock;
+    condition_variable clients_done;
+
+    shared_ptr<served_charts> current();
+    void answer(string_view request, string &reply);
+    void serve_client(int fd);
+public:
+    header_server(const command_line_info &options, const string &filename, header_output &out)
+        : opt(options), in_filename(filename), output(out), listen_fd(-1) {}
+    ~header_server();
+
+    bool reload(string &error);
+    bool listen(const string &name, string &error);
+    bool run(volatile sig_atomic_t &stop);
+    size_t count()              { return current()->names.size(); }
+};
+
+header_server::~header_server()
+{
+    if (listen_fd >= 0)
+    {
+        ::close(listen_fd);
+        unlink(socket_name.c_str());
+    }
+}
+
+shared_ptr<served_charts> header_server::current()
+{
+    lock_guard<mutex> guard(charts_lock);
+    return charts;
+}
+
+// Read the input file again. The charts read before stay in use if it
+// can't be read.
+bool header_server::reload(string &error)
+{
+    lock_guard<mutex> guard(reload_lock);
+    shared_ptr<served_charts> fresh(new served_charts);
+    if (!fresh->load(in_filename, opt, error)) return false;
+
+    lock_guard<mutex> charts_guard(charts_lock);
+    charts.swap(fresh);
+    return true;
+}
+
+// Make the socket. One left behind by a server that is gone is replaced,
+// one that a server still answers on is not.
+bool header_server::listen(const string &name, string &error)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (name.length() >= sizeof(addr.sun_path))
+    {
+        error = "Socket name too long: " + name;
+        return false;
+    }
+    memcpy(addr.sun_path, name.c_str(), name.length());
+
+    struct stat st;
+    if (lstat(name.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+    {
+        int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        bool in_use = probe >= 0 && connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0;
+        if (probe >= 0) ::close(probe);
+        if (in_use)
+        {
+            error = "Already serving on " + name;
+            return false;
+        }
+        unlink(name.c_str());
+    }
+
+    listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        ::listen(listen_fd, 64) != 0)
+    {
+        error = "Could not listen on " + name + ": " + strerror(errno);
+        if (listen_fd >= 0) ::close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+    socket_name = name;
+    return true;
 }
 
-// Search field in buffer and convert to long (return NAN_L if undefined) 
-long int input_buffer::field_long(const string &field_name, unsigned int index) const
+static void reply_ok(string &reply, string_view body)
 {
-    return (long int) field_double(field_name, index);
+    reply += "ok ";
+    reply += to_string(body.length());
+    reply += '\n';
+    reply += body;
 }
 
-// Extract field from a string with comma separated substrings 
-const string extract_field(const string &in_string, unsigned int field_number)
+// Answer a request line, appending the reply
+void header_server::answer(string_view request, string &reply)
 {
-    unsigned int cp = 0;
-    
-    while(field_number > 0 && cp != string::npos)
+    if (request == "list")
     {
-        cp = in_string.find_first_of(',', cp);
-        if (cp != string::npos) cp++;
-        field_number--;
+        shared_ptr<served_charts> c = current();
+        string body;
+        for (size_t i = 0; i < c->names.size(); i++)
+        {
+            body += c->names[i];
+            body += '\n';
+        }
+        reply_ok(reply, body);
     }
-    
-    if (in_string.empty() || cp == string::npos)
+    else if (request.compare(0, 4, "get ") == 0)
     {
-        return "";
+        shared_ptr<served_charts> c = current();
+        const string *header = c->header(string(request.substr(4)), opt.polynomials);
+        if (header) reply_ok(reply, *header);
+        else        reply += "error Chart not found\n";
     }
-    else
+    else if (request == "reload")
     {
-        unsigned int ep = in_string.find_first_of(',', cp);
-        if (ep == string::npos)
+        string error;
+        if (reload(error))
         {
-            ep = in_string.length();
+            string text = "Read " + to_string(count()) + " charts from " + in_filename;
+            output.message(text);
+            reply_ok(reply, text + "\n");
+        }
+        else
+        {
+            output.message(error);
+            reply += "error " + error + "\n";
         }
-        
-        return in_string.substr(cp, ep-cp);
+    }
+    else
+    {
+        reply += "error Unknown request\n";
     }
 }
 
-// int to string convert
-string itoa(int value)
-{
-    char cbuf[15];
-    snprintf(cbuf, sizeof(cbuf), "%d", value);
-    cbuf[sizeof(cbuf)-1] = 0;
-    return string(cbuf);
-}
-
-// Remove trailing whitespaces
-string &trim_trailing(string &s)
+// Client thread: answer the requests of a connection until it is closed
+void header_server::serve_client(int fd)
 {
-    unsigned int last  = s.find_last_not_of("\n\r\t ");
-    if (last != string::npos)
+    const size_t MAX_REQUEST = 4096;
+    char in[4096];
+    string pending, reply;
+    for (;;)
     {
-        s = s.substr(0, last+1);
+        ssize_t len = recv(fd, in, sizeof(in), 0);
+        if (len < 0 && errno == EINTR) continue;
+        if (len <= 0) break;
+        pending.append(in, len);
+
+        // Answer all complete lines, and send the replies together
+        reply.clear();
+        string::size_type start = 0, end;
+        while ((end = pending.find('\n', start)) != string::npos)
+        {
+            string_view request(pending.data() + start, end - start);
+            if (!request.empty() && request.back() == '\r') request.remove_suffix(1);
+            answer(request, reply);
+            start = end + 1;
+        }
+        pending.erase(0, start);
+        if (pending.length() > MAX_REQUEST)
+        {
+            reply += "error Request too long\n";
+        }
+
+        bool sent = true;
+        for (size_t done = 0; sent && done < reply.length(); )
+        {
+            ssize_t n = send(fd, reply.data() + done, reply.length() - done, MSG_NOSIGNAL);
+            if (n < 0 && errno == EINTR) continue;
+            sent = n > 0;
+            if (sent) done += n;
+        }
+        if (!sent || pending.length() > MAX_REQUEST) break;
     }
-    return s;
+
+    lock_guard<mutex> guard(clients_lock);
+    clients.erase(fd);
+    ::close(fd);
+    clients_done.notify_all();
 }
 
-// Remove leading and trailing whitespaces
-string &trim(string &s)
+// Take connections until stop is set (by a signal), then close the ones
+// still open and wait for their threads. The signals that stop the server
+// are to be blocked, so they reach this thread, in ppoll(), and no other.
+bool header_server::run(volatile sig_atomic_t &stop)
 {
-    unsigned int first = s.find_first_not_of("\n\r\t ");
-    if (first == string::npos)
+    sigset_t waiting;
+    pthread_sigmask(SIG_SETMASK, 0, &waiting);
+    sigdelset(&waiting, SIGINT);
+    sigdelset(&waiting, SIGTERM);
+
+    bool ok = true;
+    while (!stop)
     {
-        s = "";
+        struct pollfd p = { listen_fd, POLLIN, 0 };
+        int r = ppoll(&p, 1, 0, &waiting);
+        if (r < 0 && errno != EINTR)
+        {
+            ok = false;
+            break;
+        }
+        if (r <= 0) continue;
+
+        int fd = accept4(listen_fd, 0, 0, SOCK_CLOEXEC);
+        if (fd < 0) continue;
+        lock_guard<mutex> guard(clients_lock);
+        clients.insert(fd);
+        thread(&header_server::serve_client, this, fd).detach();
     }
-    else
+
+    unique_lock<mutex> guard(clients_lock);
+    for (unordered_set<int>::const_iterator it = clients.begin(); it != clients.end(); ++it)
     {
-        int last  = s.find_last_not_of("\n\r\t ");
-        s = s.substr(first, last+1-first);
+        shutdown(*it, SHUT_RDWR);
     }
-    return s;
+    while (!clients.empty()) clients_done.wait(guard);
+    return ok;
 }
 
-// Convert a section of a MapCal file. The strings are stored in an input_buffer
-void convert_section(input_buffer &buf, const command_line_info &opt)
+// Serve the headers of a file on a socket until stopped
+static int run_server(const command_line_info &opt)
 {
-    string mc_chart_name;
-    string st;
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_watching;
+    sigaction(SIGINT, &sa, 0);
+    sigaction(SIGTERM, &sa, 0);
+    sigset_t stop_signals;
+    sigemptyset(&stop_signals);
+    sigaddset(&stop_signals, SIGINT);
+    sigaddset(&stop_signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &stop_signals, 0);    // before any thread starts
 
-    // Line 0 is always the chart title enclosed in []
-    mc_chart_name = buf.line(0).substr(1, buf.line(0).length()-2);
-    unsigned int find_end = mc_chart_name.find_last_of('.');
-    if (find_end != string::npos)
+    header_output output;
+    header_server server(opt, opt.in_filenames[0], output);
+    string error;
+    if (!server.reload(error) || !server.listen(opt.sw_serve, error))
     {
-        mc_chart_name=mc_chart_name.substr(0,find_end);
+        cout<<error<<endl;
+        return 1;
     }
 
-    if (opt.sw_out_name.empty())
-    {
-        if (opt.sw_ext.empty())
-            st = mc_chart_name + ".hdr";
-        else
-            st = mc_chart_name + "." + opt.sw_ext;
-    }
-    else
+    output.message("Serving " + to_string(server.count()) + " charts on " + opt.sw_serve + ", stop with Ctrl-C");
+    if (!server.run(stop_requested))
     {
-         st = opt.sw_out_name;
+        output.message("Could not take connections on " + opt.sw_serve);
+        return 1;
     }
-  
-    // Open file
-    cout << "Create "  << st << endl;
-    ofstream outFile ( st.c_str() );
+    return 0;
+}
 
-    // Calculate derived values
-    long int sc = buf.field_long("SC"); 
-    double   dx = buf.field_double("DX"); 
-    double   dy = buf.field_double("DY");
-    long int du = 0;
-    
-    if (sc != 0   && sc != buf.NAN_L &&
-        dx != 0.0 && dx != buf.NAN_D &&
-        dy != 0.0 && dy != buf.NAN_D)
+// --ask: send the request lines of stdin to a --serve socket and print the
+// replies: what comes with "ok", and the reason of an "error" on stderr.
+// Stands in for a real client, for trying a server out.
+static int run_client(const command_line_info &opt)
+{
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (opt.sw_ask.length() >= sizeof(addr.sun_path) || fd < 0)
     {
-        du = (long int) ((sc * 2.54 / (( dx + dy ) / 2.0 * 100.0)) + 0.5);
+        cout<<"Could not connect to " << opt.sw_ask << endl;
+        return 1;
     }
-    
-    long int projection;
-    projection = buf.field_long("PR");
-    if ((projection==buf.NAN_L)||(projection>3)) projection = 0;
-    string pr = extract_field("UNKNOWN,MERCATOR,TRANSVERSE MERCATOR,LAMBERT CONFORMAL CONIC", projection);
-       
-    long int i = buf.field_long("DU");
-    if (i==buf.NAN_L) i = 0;
-    string un = extract_field("UNKNOWN,METERS,FEET,FATHOMS", i);
-    
-    // Output the file
-    outFile << "! Created by mc2bsbh " << VERSION << " - Use at your own risk!" << endl;
-    
-    // In this section the CR field is processed. The CR field is the CHARTCAL.DIR comment and
-    // it is made of multiple lines first of which is CR=... and next starts with a space char.
-    // Each line may be a comment (to be just copied in the BSB header) or a command.
-    // Command starts with the keyword BSBHDR and may be of 2 types:
-    //    1) commands for superseeding default BSB and KNP values:
-    //		  - these commands are in the form BSBHDR KNP/SC=xxx,PP=yyy
-    //    2) commands for adding a totally new line to the header
-    //		  - these commands never use KNP/ or BSB/ parameter.
-    
-    st = buf.field("CR");
-
-    if (!st.empty())
+    memcpy(addr.sun_path, opt.sw_ask.c_str(), opt.sw_ask.length());
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
     {
-        string cline,tline;
-    
-        input_buffer tmp;
-    
-        unsigned int brk = 0;
-        int addn = 1, tfield;
-        
-        do
-        {
-            unsigned int nxt = st.find_first_of("\t\r\n",brk);
-            if (nxt == string::npos) nxt = st.length() + 1;
-            cline = st.substr(brk, nxt-brk);
-            
-            if (cline.substr(0,6) == "BSBHDR")
-            {
-                cline=cline.substr(6);
-                
-                while (cline.at(0) == ' ') cline=cline.substr(1);
-                
-                if (cline.substr(0,4)=="KNP/")
-                {
-                    tmp.add_line("KNP="+cline.substr(4));
-					
-                    tfield=0;
-                    tline=tmp.field_string("KNP",tfield);
-                    while (!tline.empty())
-                    {
-                        buf.add_line(tline);
-                        tfield++;
-                        tline=tmp.field_string("KNP",tfield);
-                    }  
-                }
-                else if (cline.substr(0,4)=="BSB/")
-                {
-                    tmp.add_line("BSB="+cline.substr(4));
-					
-                    tfield=0;
-                    tline=tmp.field_string("BSB",tfield);
-                    while (!tline.empty())
-                    {
-                        buf.add_line(tline);
-                        tfield++;
-                        tline=tmp.field_string("BSB",tfield);
-                    }
-                }
-                else
-                {
-                    buf.add_line("ADD"+itoa(addn)+"="+cline);
-                    addn++;
-                }
-            }
-            else
-            {
-                outFile << "! " << cline << endl;
-            }
-            
-            brk=nxt+1;
-        } while (brk <= st.length());
+        cout<<"Could not connect to " << opt.sw_ask << ": " << strerror(errno) << endl;
+        ::close(fd);
+        return 1;
     }
-   
-    string pp,pi,sp,sk,ta,sd;
-    
-    if (buf.field_double("PP")==buf.NAN_D) pp="UNKNOWN"; else pp=buf.field("PP");
-    if (buf.field_double("PI")==buf.NAN_D) pi="UNKNOWN"; else pi=buf.field("PI");
-    if (buf.field_double("SP")==buf.NAN_D) sp="UNKNOWN"; else sp=buf.field("SP");
-    if (buf.field_double("SK")==buf.NAN_D) sk="0.0";     else sk=buf.field("SK");
-    if (buf.field_double("TA")==buf.NAN_D) ta="90.0";    else ta=buf.field("TA");
-    if (buf.field("SD").empty())           sd="UNKNOWN"; else sd=buf.field("SD");     
-    
-    outFile << "VER/2.0" << endl;
-    
-    outFile << "BSB/NA=" << buf.field("NA") << endl;
-    outFile << "    NU=" << buf.field("NU") << ",RA=" << buf.field("WI") << "," << buf.field("HE") << ",DU=" << du << endl;
-
-    outFile << "KNP/SC=" << sc << ",GD=" << buf.field("GD") << ",PR=" << pr;
-
-    double lon0 = buf.field_double("LON0");
-    if ((lon0!=buf.NAN_D)&&(projection==2)&&(pp=="UNKNOWN"))
-         outFile << ",PP=" << lon0 << endl;
-    else
-         outFile << ",PP=" << pp << endl;
-
-    outFile << "    PI=" << pi << ",SP=" << sp << ",SK=" << sk << ",TA=" << ta << endl;
-    outFile << "    UN=" << un << ",SD=" << sd << endl;
-    outFile << "    DX=" << dx << ",DY=" << dy << endl;
 
-    unsigned int cnt;
-    
-    cnt=1;
-    for(;;)
+    // The bytes received and not used yet are kept in pending
+    string request, pending;
+    char in[65536];
+    auto receive = [&]() -> bool
     {
-        st = buf.field("ADD" + itoa(cnt));
-        if (st.empty())
-            break;
+        ssize_t len;
+        do len = recv(fd, in, sizeof(in), 0); while (len < 0 && errno == EINTR);
+        if (len > 0) pending.append(in, len);
+        return len > 0;
+    };
 
-        outFile << st << endl;        
-        
-        cnt++;
-    }
-    
-    outFile << "OST/1" << endl;
-    
-    long int refx, refy, maxlonx, minlonx;
-    double lat, lon, maxlon=-181.0, minlon=181.0;
-    
-	outFile.precision(9);
-    cnt=1;
-    for(;;)
-    {
-        st = buf.field("C" + itoa(cnt));
-        if (st.empty())
-            break;
-            
-        refx = buf.field_long("C" + itoa(cnt),0);
-        refy = buf.field_long("C" + itoa(cnt),1);        
-        lat  = buf.field_double("C" + itoa(cnt),2);
-        lon  = buf.field_double("C" + itoa(cnt),3);
-        
-        if (lon>180.0) lon=lon-360.0;
-        if (lon>maxlon) { maxlon=lon; maxlonx=refx;}
-        if (lon<minlon) { minlon=lon; minlonx=refx;}
-        
-        outFile << "REF/" << cnt << "," << refx << "," << refy << ","
-                                        << lat << "," << lon << endl;
-        cnt++;
-    }
-    
-    if((maxlon*minlon)<0.0 && (maxlonx < minlonx))
-    {
-        outFile << "CPH/180.0" << endl;
-    }
-    else
-    {
-        outFile << "CPH/0.0" << endl;
-    }
-        
-    cnt=1;
-    for(;;)
+    int result = 0;
+    while (getline(cin, request))
     {
-        st = buf.field("B" + itoa(cnt));
-        if (st.empty())
+        request += '\n';
+        if (send(fd, request.data(), request.length(), MSG_NOSIGNAL) != (ssize_t) request.length())
+        {
+            cout<<"Lost the connection to " << opt.sw_ask << endl;
+            result = 1;
             break;
-            
-        lat  = buf.field_double("B" + itoa(cnt),0);
-        lon  = buf.field_double("B" + itoa(cnt),1);
-        
-        if (lon>180.0) lon=lon-360.0;
-         
-        outFile << "PLY/" << cnt << "," << lat << "," << lon << endl;        
-        
-        cnt++;
-    }
-    
-    outFile << "DTM/" << buf.field_double("DS",0)*3600.0 << ","
-            << buf.field_double("DS",1)*3600.0 << endl;
+        }
 
-    outFile.close();
-}
+        string::size_type end;
+        bool connected = true;
+        while (connected && (end = pending.find('\n')) == string::npos) connected = receive();
+        if (!connected)
+        {
+            cout<<"Lost the connection to " << opt.sw_ask << endl;
+            result = 1;
+            break;
+        }
+        string line = pending.substr(0, end);
+        pending.erase(0, end + 1);
 
-void ExitError(string error)
-{
-    cout << error << endl;
-    exit(1);
+        if (line.compare(0, 3, "ok ") == 0)
+        {
+            size_t length = strtoull(line.c_str() + 3, 0, 10);
+            while (connected && pending.length() < length) connected = receive();
+            if (!connected)
+            {
+                cout<<"Lost the connection to " << opt.sw_ask << endl;
+                result = 1;
+                break;
+            }
+            cout.write(pending.data(), length);
+            pending.erase(0, length);
+        }
+        else
+        {
+            cerr<<line.substr(line.compare(0, 6, "error ") == 0 ? 6 : 0)<<endl;
+            result = 1;
+        }
+    }
+    cout << flush;
+    ::close(fd);
+    return result;
 }
 
-
 // Main; read and split the file in sections
 int main ( int argc, char *argv[] )
 {
@@ -494,15 +2346,23 @@ int main ( int argc, char *argv[] )
     
     opt.debug_on=false;
     opt.list=false;
-    opt.sw_single="";
+    opt.stats=false;
+    opt.stats_json=false;
+    opt.watch=false;
+    opt.use_index=false;
+    opt.polynomials=false;
+    opt.stream_out=false;
+    opt.list_format="text";
+    opt.header_files=true;
+    opt.threads=1;
     opt.sw_ext="";
     opt.sw_out_name="";
-    opt.in_filename="";
+    opt.sw_archive="";
+    opt.sw_cache="";
+    opt.sw_out_dir="";
 
-    string incoming;
     int argcount;
-    unsigned int find_end, nout;
-    string in_switch, chart_name;
+    string in_switch;
     
     // Scan command line arguments
     argcount=1;
@@ -519,11 +2379,36 @@ int main ( int argc, char *argv[] )
         {
             opt.list=true;
         }
-        else                           // -s SingleChart (extract a single chart)
+        else                           // -j Threads (convert on several threads)
+        if (in_switch == "-j" && argcount < argc-1)
+        {
+            argcount++;
+            char *end;
+            long int threads = strtol(argv[argcount], &end, 10);
+            if (end == argv[argcount] || *end != 0 || threads < 0)
+            {
+                cout<<"-j needs a number of threads, 0 for one per CPU"<<endl;
+                return 1;
+            }
+            opt.threads = (unsigned int) min(threads, (long int) MAX_THREADS);
+            if (opt.threads == 0) opt.threads = min(thread::hardware_concurrency(), MAX_THREADS);
+            if (opt.threads == 0) opt.threads = 1;
+        }
+        else                           // -s Chart (extract a chart; may be repeated)
         if (in_switch == "-s" && argcount < argc-1)
         {
             argcount++;
-            opt.sw_single = argv[argcount];
+            opt.sw_single.add(argv[argcount]);
+        }
+        else                           // -S Listfile (extract the charts named in a file)
+        if (in_switch == "-S" && argcount < argc-1)
+        {
+            argcount++;
+            if (!opt.sw_single.add_file(argv[argcount]))
+            {
+                cout<<"Could not read chart list " << argv[argcount] << endl;
+                return 1;
+            }
         }
         else                          // -e File extension (force file extension)
         if (in_switch == "-e" && argcount < argc-1)
@@ -531,123 +2416,398 @@ int main ( int argc, char *argv[] )
             argcount++;
             opt.sw_ext = argv[argcount];
         }
+        else                          // -a Archive (write all headers into a tar file)
+        if (in_switch == "-a" && argcount < argc-1)
+        {
+            argcount++;
+            opt.sw_archive = argv[argcount];
+        }
+        else                          // -c Cache (skip sections that did not change)
+        if (in_switch == "-c" && argcount < argc-1)
+        {
+            argcount++;
+            opt.sw_cache = argv[argcount];
+        }
+        else                          // -O (write all headers to stdout, framed)
+        if (in_switch == "-O")
+        {
+            opt.stream_out=true;
+        }
         else                          // -o Header file name (force header Name)
         if (in_switch == "-o" && argcount < argc-1)
         {
             argcount++;
             opt.sw_out_name = argv[argcount];
         }
-        else
-        if (in_switch.at(0) != '-')
+        else                          // -D Directory (put the headers under a directory)
+        if (in_switch == "-D" && argcount < argc-1)
         {
-            opt.in_filename = argv[argcount];
+            argcount++;
+            opt.sw_out_dir = argv[argcount];
+            while (opt.sw_out_dir.length() > 1 && opt.sw_out_dir[opt.sw_out_dir.length()-1] == '/')
+                opt.sw_out_dir.erase(opt.sw_out_dir.length()-1);
+        }
+        else                          // --stats (print statistics at the end)
+        if (in_switch == "--stats" || in_switch == "--stats=json")
+        {
+            opt.stats = true;
+            opt.stats_json = (in_switch == "--stats=json");
+        }
+        else                          // --format=Format (of the list of charts)
+        if (in_switch.compare(0, 9, "--format=") == 0)
+        {
+            opt.list_format = in_switch.substr(9);
+        }
+        else                          // -x (use a sidecar index for -s and -l)
+        if (in_switch == "-x")
+        {
+            opt.use_index=true;
+        }
+        else                          // -g Indexfile (write, or with -q read, a coverage index)
+        if (in_switch == "-g" && argcount < argc-1)
+        {
+            argcount++;
+            opt.sw_coverage = argv[argcount];
+        }
+        else                          // -q Query (charts at lat,lon or in south,west,north,east)
+        if (in_switch == "-q" && argcount < argc-1)
+        {
+            argcount++;
+            opt.queries.push_back(argv[argcount]);
+        }
+        else                          // -t geo|pixel (transform points with the chart of -s)
+        if (in_switch == "-t" && argcount < argc-1)
+        {
+            argcount++;
+            opt.transform = argv[argcount];
+        }
+        else                          // -i Pointsfile (the points for -t)
+        if (in_switch == "-i" && argcount < argc-1)
+        {
+            argcount++;
+            opt.sw_points = argv[argcount];
+        }
+        else                          // -f Formats (the files to make of each section)
+        if (in_switch == "-f" && argcount < argc-1)
+        {
+            argcount++;
+            if (!set_formats(opt, argv[argcount])) return 1;
+        }
+        else                          // -p (add polynomials fitted to the REF points)
+        if (in_switch == "-p")
+        {
+            opt.polynomials=true;
+        }
+        else                          // --watch (convert changed sections until stopped)
+        if (in_switch == "--watch")
+        {
+            opt.watch = true;
+        }
+        else                          // --serve Socket (answer requests for headers until stopped)
+        if (in_switch == "--serve" && argcount < argc-1)
+        {
+            argcount++;
+            opt.sw_serve = argv[argcount];
+        }
+        else                          // --ask Socket (send the request lines of stdin to --serve)
+        if (in_switch == "--ask" && argcount < argc-1)
+        {
+            argcount++;
+            opt.sw_ask = argv[argcount];
+        }
+        else                          // Input file, or - for stdin
+        if (in_switch.at(0) != '-' || in_switch == "-")
+        {
+            string name = argv[argcount];
+            while (name.length() > 1 && name[name.length()-1] == '/') name.erase(name.length()-1);
+            opt.in_filenames.push_back(name);
         }
 
         argcount++;
     }
 
-    if ( opt.in_filename.empty() )
+    if ( !opt.queries.empty() )
+    {
+        return run_queries(opt);
+    }
+    if ( !opt.sw_ask.empty() )
+    {
+        return run_client(opt);
+    }
+
+    if ( opt.in_filenames.empty() )
     {
         cout<<endl;
         cout<<"mc2bsbh ("<<VERSION<<"): converts georeference format from MapCal to BSB header\n\n";
-        cout<<"Usage: mc2bsbh [-d] [-s chartname] [-o outfile | -e extension] [-l] <infile>"<<endl<<endl;
-        cout<<"       <infile>     : the output from MapCal - normally CHARTCAL.DIR"<<endl;
+        cout<<"Usage: mc2bsbh [-d] [-j threads] [-s chartname] [-S listfile] [-o outfile | -e extension] [-a archive | -O] [-c cachefile] [-D outdir] [-l [--format=fmt]] [-x] [-p] [-f formats] [-g indexfile] [--stats[=json]] [--watch] <infile|dir> ..."<<endl;
+        cout<<"       mc2bsbh -g indexfile -q lat,lon|south,west,north,east|- ..."<<endl;
+        cout<<"       mc2bsbh -s chartname -t geo|pixel [-i pointsfile] <infile>"<<endl;
+        cout<<"       mc2bsbh [-j threads] [-s chartname] [-S listfile] [-p] --serve socket <infile>"<<endl;
+        cout<<"       mc2bsbh --ask socket < requests"<<endl<<endl;
+        cout<<"       <infile>     : the output from MapCal - normally CHARTCAL.DIR (- for stdin)"<<endl;
+        cout<<"       <dir>        : convert every *.dir file below dir, each next to its input"<<endl;
         cout<<"       -d           : this is debug mode. It prints out a bunch of garbage"<<endl;
-        cout<<"       -s chartname : convert a single chart header from <infile>"<<endl;
+        cout<<"       -j threads   : convert on this many threads (0 = one per CPU, at most 256)"<<endl;
+        cout<<"       -s chartname : convert a single chart header from <infile> (again for more;"<<endl;
+        cout<<"                      * ? and [] match like file names)"<<endl;
+        cout<<"       -S listfile  : convert the charts named in listfile, one per line"<<endl;
         cout<<"       -o outfile   : to specify your own header file name"<<endl;
         cout<<"       -e extention : to specify your own header extension"<<endl;
+        cout<<"       -a archive   : write all headers into one tar file (- for stdout)"<<endl;
+        cout<<"       -O           : write all headers to stdout, each after a line with its name"<<endl;
+        cout<<"       -c cachefile : only rewrite the headers whose section has changed"<<endl;
+        cout<<"       -D outdir    : put the headers under outdir, in the layout of the input"<<endl;
         cout<<"       -l           : to print out just the list of charts in <infile>"<<endl;   
+        cout<<"       --format=fmt : list as text, tsv or json (with SC and point counts)"<<endl;
+        cout<<"       -x           : for -s and -l, keep an index of <infile> in <infile>.idx"<<endl;
+        cout<<"       -p           : add WPX/, WPY/, PWX/, PWY/ and ERR/ fitted to the REF points"<<endl;
+        cout<<"       -f formats   : the files to make of each chart, of hdr (the default), geojson,"<<endl;
+        cout<<"                      wld and aux.xml, separated by commas"<<endl;
+        cout<<"       -g indexfile : also write a coverage index of the PLY outlines of the charts"<<endl;
+        cout<<"       -q query     : print the charts in indexfile at lat,lon or in a box (- for stdin)"<<endl;
+        cout<<"       -t geo|pixel : turn x,y lines of pointsfile (or stdin) into lat,lon, or back"<<endl;
+        cout<<"       --stats      : print counters and timings at the end (=json for JSON)"<<endl;
+        cout<<"       --watch      : keep converting the sections that change, until stopped"<<endl;
+        cout<<"       --serve sock : answer get <chart>, list and reload requests until stopped"<<endl;
+        cout<<"       --ask sock   : send the request lines of stdin to a --serve socket"<<endl;
               
         return 0;
     }
 
-    ifstream inFile(opt.in_filename.c_str());
-    if ( !inFile.is_open() )
+    if (opt.list_format != "text" && opt.list_format != "tsv" && opt.list_format != "json")
     {
-        cout<<"Could not open file " << opt.in_filename << endl;
-        return 0;
+        cout<<"Unknown list format " << opt.list_format << endl;
+        return 1;
+    }
+    if (!opt.transform.empty())
+    {
+        if (opt.transform != "geo" && opt.transform != "pixel")
+        {
+            cout<<"Unknown transform " << opt.transform << endl;
+            return 1;
+        }
+        if (opt.sw_single.empty() || opt.in_filenames.size() != 1)
+        {
+            cout<<"-t needs -s chartname and one <infile>"<<endl;
+            return 1;
+        }
+        if (opt.in_filenames[0] == "-" && (opt.sw_points.empty() || opt.sw_points == "-"))
+        {
+            cout<<"-t can not read both <infile> and the points from stdin"<<endl;
+            return 1;
+        }
+        mapped_file calFile;
+        if ( !calFile.open(opt.in_filenames[0]) )
+        {
+            cout<<"Could not open file " << opt.in_filenames[0] << endl;
+            return 1;
+        }
+        return run_transform(calFile, opt);
+    }
+
+    if (!opt.sw_serve.empty())
+    {
+        if (opt.in_filenames.size() != 1 || opt.in_filenames[0] == "-")
+        {
+            cout<<"--serve needs one <infile>, not stdin"<<endl;
+            return 1;
+        }
+        if (opt.watch || opt.list || !opt.sw_archive.empty() || opt.stream_out || !opt.sw_coverage.empty() ||
+            !opt.header_files || !opt.sinks.empty())
+        {
+            cout<<"--serve can not be used with -l, -a, -O, -f, -g or --watch"<<endl;
+            return 1;
+        }
+        return run_server(opt);
+    }
+
+    if (opt.watch && (opt.list || !opt.sw_archive.empty() || opt.stream_out || !opt.sw_coverage.empty()))
+    {
+        cout<<"--watch can not be used with -l, -a, -O or -g"<<endl;
+        return 1;
+    }
+    if (opt.watch && find(opt.in_filenames.begin(), opt.in_filenames.end(), "-") != opt.in_filenames.end())
+    {
+        cout<<"--watch can not read from stdin"<<endl;
+        return 1;
+    }
+    if (opt.stream_out && !opt.sw_archive.empty())
+    {
+        cout<<"-O can not be used with -a"<<endl;
+        return 1;
+    }
+
+    // A single input file is converted on a pipeline, with its headers in
+    // the current directory. More files, or directories, make a batch.
+    struct stat st;
+    bool batch = opt.in_filenames.size() > 1 ||
+                 (stat(opt.in_filenames[0].c_str(), &st) == 0 && S_ISDIR(st.st_mode));
+    string out_dir = opt.sw_out_dir.empty() ? string() : opt.sw_out_dir + "/";
+    unsigned int threads = opt.threads;
+    if (opt.debug_on || opt.list)
+    {
+        threads = 0;        // debug output is only readable if the conversion follows the reading
+    }
+
+    mapped_file inFile;
+    vector<input_file> files;
+    if (!batch)
+    {
+        if ( !inFile.open(opt.in_filenames[0]) )
+        {
+            cout<<"Could not open file " << opt.in_filenames[0] << endl;
+            return 0;
+        }
+    }
+    else
+    {
+        for (unsigned int u = 0; u < opt.in_filenames.size(); u++)
+        {
+            const string &name = opt.in_filenames[u];
+            if (stat(name.c_str(), &st) == 0 && S_ISDIR(st.st_mode))
+            {
+                find_inputs(name, opt.sw_out_dir.empty() ? name + "/" : out_dir, opt, files);
+            }
+            else
+            {
+                input_file f = { name, opt.sw_out_dir.empty() ? directory_of(name) : out_dir, 0 };
+                if (stat(name.c_str(), &st) == 0) f.size = st.st_size;
+                files.push_back(f);
+            }
+        }
+        if (files.empty())
+        {
+            cout<<"No calibration files found"<<endl;
+            return 1;
+        }
+        if (threads > 1)
+        {
+            // The big files first, so none of them is started last
+            stable_sort(files.begin(), files.end(),
+                        [](const input_file &a, const input_file &b) { return a.size > b.size; });
+        }
     }
     
-    input_buffer inp;
-    nout=0;
-        
-    // Read the whole file
-    while(!inFile.eof())
+    header_output output;
+    if ( !opt.sw_archive.empty() && !opt.list && !output.open_archive(opt.sw_archive) )
+    {
+        cout<<"Could not create archive " << opt.sw_archive << endl;
+        return 1;
+    }
+    if ( opt.stream_out && !opt.list )
+    {
+        output.open_stream();
+    }
+    coverage_builder coverage;
+    if ( !opt.sw_coverage.empty() && !opt.list )
+    {
+        output.coverage = &coverage;
+    }
+    if ( !opt.sw_cache.empty() && opt.sw_archive.empty() && !opt.stream_out && !opt.list &&
+         !output.open_cache(opt.sw_cache) )
+    {
+        cout<<"Bad cache file " << opt.sw_cache << endl;
+        return 1;
+    }
+
+    run_stats stats;
+    long long start = now_ns();
+    atomic<bool> failed(false);
+    bool make_out_dirs = !opt.sw_out_dir.empty() && !opt.list && opt.sw_archive.empty() && !opt.stream_out;
+
+    if (!batch)
     {
-        getline(inFile, incoming);
-        trim_trailing(incoming);
-        if (opt.debug_on)
+        string error;
+        if (make_out_dirs && !make_dirs(opt.sw_out_dir))
         {
-            cout<< "Read line - " << incoming << endl;
+            cout<<"Could not create directory " << opt.sw_out_dir << endl;
+            return 1;
         }
-        
-        if((!incoming.empty()) && (incoming.at(0)!=';'))
+        if (!process_file(inFile, opt.in_filenames[0], out_dir, threads, opt, output, stats, error))
+        {
+            output.message(error);      // not into the headers on stdout
+            exit(1);
+        }
+        inFile.close();
+    }
+    else
+    {
+        // Each file is converted by a single thread; -j files are converted
+        // at the same time
+        work_pool pool(threads > 0 ? threads : 1, files.size());
+        pool.run([&](size_t item)
         {
-            // Starting a new section when we see the []-line
-            if (incoming.at(0) == '[' && incoming.at(incoming.length()-1) == ']')
+            const input_file &f = files[item];
+            mapped_file batchFile;
+            string error;
+
+            if (!batchFile.open(f.name))
             {
-                // Already something picked up?
-                if (!inp.empty())
-                {
-                    // Convert and save the current buffer before starting a new one
-                    chart_name = inp.field("FN");
-                    find_end = chart_name.find_last_of('.');
-                    if (find_end != string::npos)
-                    {
-                        chart_name=chart_name.substr(0,find_end);
-                    }                   
-                    if (opt.list)
-                    {
-                        cout.width(15);
-                        cout << left << chart_name;
-                        cout << inp.field("NA") << endl;
-                    }
-                    else if ((opt.sw_single=="")||(chart_name==opt.sw_single))
-                    {                
-                        convert_section(inp, opt);
-                        nout++;
-                    }
-                    inp.reset();
-                }
+                output.message("Could not open file " + f.name);
+                failed = true;
             }
-           
-            if (incoming.at(0) == ' ')
+            else if (make_out_dirs && !make_dirs(f.out_dir))
             {
-                if(!inp.append_line(trim(incoming))) ExitError("Bad Calibration File");
+                output.message("Could not create directory " + f.out_dir);
+                failed = true;
             }
             else
             {
-               // Appending line to the buffer
-               inp.add_line(trim(incoming));
+                if (opt.list && opt.list_format == "text") output.message(f.name + ":");
+                if (!process_file(batchFile, f.name, f.out_dir, 0, opt, output, stats, error))
+                {
+                    output.message(error + ": " + f.name);
+                    failed = true;
+                }
             }
-        }
+        });
     }
 
-    inFile.close();
-   
-    // Convert the last section, if any
-    if (!inp.empty())
+    if (opt.watch)
     {
-        // Convert and save the current buffer before starting a new one
-        chart_name = inp.field("FN");
-        find_end = chart_name.find_last_of('.');
-        if (find_end != string::npos)
+        file_watcher watcher(opt, output, stats);
+        if (!batch)
         {
-            chart_name=chart_name.substr(0,find_end);
-        }                   
-        if (opt.list)
+            input_file f = { opt.in_filenames[0], out_dir, 0 };
+            files.push_back(f);
+        }
+        for (unsigned int u = 0; u < files.size(); u++)
         {
-            cout.width(15);
-            cout << left << chart_name;
-            cout << inp.field("NA") << endl;
+            if (!watcher.add(files[u].name, files[u].out_dir))
+                output.message("Could not watch file " + files[u].name);
         }
-        else if ((opt.sw_single=="")||(chart_name==opt.sw_single))
-        {                
-            convert_section(inp, opt);
-            nout++;
+
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = stop_watching;          // no SA_RESTART, so poll() returns
+        sigaction(SIGINT, &sa, 0);
+        sigaction(SIGTERM, &sa, 0);
+
+        output.message("Watching " + to_string(watcher.count()) + " file(s), stop with Ctrl-C");
+        if (!watcher.run(stop_requested))
+        {
+            output.message("Could not watch the input files");
         }
-        inp.reset();
     }
-    if (nout>0) return 0;
-    else        return 1;
+
+    if (!output.close())
+    {
+        *output.log<<"Could not write " << (opt.stream_out ? string("stdout") : opt.sw_archive.empty() ? opt.sw_cache : opt.sw_archive) << endl;
+        return 1;
+    }
+    if (output.coverage && !coverage.save(opt.sw_coverage))
+    {
+        *output.log<<"Could not write coverage index " << opt.sw_coverage << endl;
+        return 1;
+    }
+
+    if (opt.stats)
+    {
+        stats.print(*output.log, opt.stats_json, now_ns() - start);
+    }
+
+    // Done if a header was written or found up to date, for every file
+    unsigned long long nout = opt.list ? 0 : stats.sections_seen - stats.sections_skipped;
+    if (nout>0 && !failed) return 0;
+    else                   return 1;
 }
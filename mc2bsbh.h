@@ -0,0 +1,371 @@
+/*
+
+**********************************************************************
+ Copyright 2009, 2010 by Dan (Dacust), Henrik Jessen, Marco Certelli
+**********************************************************************
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+**********************************************************************
+
+libmc2bsbh: the MapCal to BSB header converter as a library.
+
+Parse:    open a CHARTCAL.DIR with mapped_file ("-" is stdin), or take any
+          text in memory, and split it into sections with section_reader.
+Convert:  convert_header() turns a section into the text of its BSB header,
+          in a string supplied by the caller.
+Write:    write_file() puts a header into its file with a single write().
+
+The sections hold string_views into the text they were read from, so the
+text must stay around while they are used.
+
+***************************************************************************
+*/
+
+#ifndef MC2BSBH_H
+#define MC2BSBH_H
+
+#define MC2BSBH_VERSION "beta09"
+
+#include <iostream>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <memory>
+
+// The whole input file. It is memory mapped, so the parser can hand out
+// string_views into it instead of copying every line.
+class mapped_file
+{
+private:
+    const char *data;
+    size_t size;
+    bool mapped;
+    std::string copy;   // the contents, if the file could not be mapped
+
+    mapped_file(const mapped_file &);               // not copyable
+    mapped_file &operator=(const mapped_file &);
+public:
+    mapped_file() : data(0), size(0), mapped(false) {}
+    ~mapped_file()                  { close(); }
+
+    bool open(const std::string &filename);
+    bool read(std::istream &in);
+    void close();
+    std::string_view contents() const   { return std::string_view(data, size); }
+};
+
+// Memory for text that does not live in the input file. It comes in blocks
+// that are kept by rewind() and handed out again, so once it has grown to
+// the size a section needs, filling it allocates nothing.
+class text_arena
+{
+private:
+    std::vector<std::unique_ptr<char[]>> blocks;
+    std::vector<size_t> block_sizes;
+    size_t current;             // the block being handed out
+    size_t used;                // bytes of it handed out
+public:
+    text_arena() : current(0), used(0) {}
+    text_arena(const text_arena &) = delete;            // not copyable, views point into it
+    text_arena &operator=(const text_arena &) = delete;
+    text_arena(text_arena &&) = default;
+    text_arena &operator=(text_arena &&) = default;
+
+    void rewind()               { current = 0; used = 0; }
+    char *allocate(size_t size);
+    std::string_view store(std::string_view text);
+};
+
+// Store the input lines in a searchable buffer. The lines are views into the
+// input file; continuation lines are kept as separate views and only joined
+// if somebody asks for the whole value of a multi-line field. All memory is
+// kept by reset(), so a buffer that is used for one section after another
+// stops allocating.
+class input_buffer
+{
+private:
+    struct line_info
+    {
+        std::string_view text;      // the first physical line
+        unsigned int first_cont;    // its continuation lines in cont[]
+        unsigned int n_cont;
+    };
+    struct index_slot
+    {
+        std::string_view name;
+        unsigned int line_number;   // NO_LINE if the slot is free
+    };
+    std::vector<line_info> lines;
+    std::vector<std::string_view> cont;
+    std::vector<index_slot> index;  // field name -> first line defining it; open addressing
+    unsigned int n_index;
+    mutable text_arena owned;       // text that does not live in the input file
+
+    static const unsigned int NO_LINE = ~0u;
+
+    void index_line(unsigned int line_number);
+    unsigned int find(std::string_view field_name) const;
+    std::string_view joined(unsigned int line_number) const;
+public:
+    void reset();
+    unsigned int count() const  { return lines.size(); }
+    bool empty() const          { return lines.empty(); }
+    input_buffer() : n_index(0) {}  // Constructor
+
+    void add_line(std::string_view new_line);
+    void add_owned_line(std::string_view new_line);
+    void add_owned_line(std::string_view name, std::string_view value);   // name=value
+    bool append_line(std::string_view append_line);
+    std::string_view line(unsigned int line_number) const;
+    std::string_view field(std::string_view field_name) const;
+    unsigned long long hash() const;
+    void field_lines(std::string_view field_name, std::vector<std::string_view> &parts) const;
+    double field_double(std::string_view field_name, unsigned int index = 0) const;
+    long int field_long(std::string_view field_name, unsigned int index = 0) const;
+    std::string_view field_string(std::string_view field_name, unsigned int index) const;
+
+    static const long int NAN_L;
+    static const double NAN_D;
+};
+
+// Splits MapCal text into sections. A section starts at a [name] line,
+// lines starting with a space continue the line before, and empty lines
+// and lines starting with ';' are skipped. The part of the text a section
+// came from reads back as that same section on its own.
+class section_reader
+{
+private:
+    std::string_view text;
+    std::string_view::size_type pos;
+    std::string_view pending;       // the [name] line of the next section
+    std::string_view::size_type pending_pos;
+    std::string_view::size_type start, end;     // of the last section read
+    std::ostream *trace;
+    std::string error_text;
+    unsigned long long nlines;
+public:
+    section_reader(std::string_view in_text)
+        : text(in_text), pos(0), pending_pos(0), start(0), end(0), trace(0), nlines(0) {}
+
+    void set_trace(std::ostream *trace_out)  { trace = trace_out; }  // print every line read
+    bool next(input_buffer &buf);
+    const std::string &error() const        { return error_text; }
+    unsigned long long lines_read() const   { return nlines; }
+    unsigned long long bytes_read() const   { return pos < text.length() ? pos : text.length(); }
+    std::string_view::size_type section_offset() const  { return start; }
+    std::string_view::size_type section_length() const  { return end - start; }
+
+    static std::string_view::size_type boundary(std::string_view text, std::string_view::size_type pos);
+};
+
+// What a listing (-l) shows of a section
+struct section_summary
+{
+    std::string_view chart;         // FN without the extension
+    std::string_view title;         // NA
+    std::string_view scale;         // SC
+    unsigned int ref_points;        // C1, C2, ... up to the first missing one
+    unsigned int ply_points;        // B1, B2, ...
+};
+
+// Finds the sections of MapCal text like section_reader, but only looks
+// at the few fields of a listing instead of building the sections. The
+// views in a summary stay valid until the next call.
+class section_scanner
+{
+private:
+    // A field of the summary: the first line that gives it a value wins,
+    // and continuation lines are joined to it
+    struct scanned_field
+    {
+        bool defined;
+        std::string_view value;
+        std::string joined;         // the value with its continuation lines
+        bool is_joined;
+    };
+
+    std::string_view text;
+    std::string_view::size_type pos;
+    std::string_view pending;       // the [name] line of the next section
+    std::string error_text;
+    unsigned long long nlines;
+
+    scanned_field fn, na, sc;
+    std::vector<unsigned char> c_points, b_points;  // which C<n> and B<n> have a value
+    scanned_field *last_field;      // the field the last line may still define
+    unsigned char *last_point;
+
+    void add_line(std::string_view line);
+    void append_line(std::string_view line);
+public:
+    section_scanner(std::string_view in_text)
+        : text(in_text), pos(0), nlines(0), last_field(0), last_point(0) {}
+
+    bool next(section_summary &summary);
+    const std::string &error() const        { return error_text; }
+    unsigned long long lines_read() const   { return nlines; }
+    unsigned long long bytes_read() const   { return pos < text.length() ? pos : text.length(); }
+};
+
+std::string_view extract_field(std::string_view in_string, unsigned int field_number);
+unsigned long long fnv_hash(std::string_view s, unsigned long long h = 14695981039346656037ULL);
+
+std::string_view section_name(const input_buffer &buf);
+std::string_view chart_name(const input_buffer &buf);
+// What went into a header, for statistics
+struct header_counts
+{
+    unsigned int ref_points;
+    unsigned int ply_points;
+};
+
+// The pixel to longitude and latitude transform of a chart, and back: the
+// polynomials that build_header() writes as WPX/, WPY/, PWX/ and PWY/,
+// fitted to the REF points by least squares. The points to transform are
+// given in separate arrays of each coordinate.
+class chart_transform
+{
+public:
+    static const unsigned int TERMS = 10;
+private:
+    unsigned int order;         // 0 until a fit has been made
+    bool cross_180;             // the polynomials take longitudes from 0 to 360
+    double wpx[TERMS], wpy[TERMS], pwx[TERMS], pwy[TERMS];
+public:
+    chart_transform() : order(0), cross_180(false) {}
+
+    bool fit(const input_buffer &buf);
+    bool fit(std::vector<double> &refs, bool across_180, unsigned int max_order = 3);
+    unsigned int fit_order() const  { return order; }
+    const double *pixel_to_lon() const  { return pwx; }    // the coefficients of PWX/
+    const double *pixel_to_lat() const  { return pwy; }    // and of PWY/
+    void write(std::ostream &outFile, const std::vector<double> &refs) const;
+    void to_geo(size_t n, const double *x, const double *y, double *lat, double *lon) const;
+    void to_pixel(size_t n, const double *lat, const double *lon, double *x, double *y) const;
+};
+
+// What build_header() read of a section's georeference: the REF points in
+// rows of x, y, lat and lon and the PLY points in rows of lat and lon, as
+// they went into the header (longitudes from -180 to 180). The views are
+// into the section.
+struct chart_values
+{
+    std::string_view chart;         // FN without the extension
+    std::string_view title;         // NA
+    long int scale;                 // SC, input_buffer::NAN_L if it has none
+    bool cross_180;                 // CPH/180.0
+    std::vector<double> refs;
+    std::vector<double> ply;
+};
+
+// With polynomials the header also gets WPX/, WPY/, PWX/, PWY/ and ERR/
+// lines, fitted to the REF points by least squares. The values the header
+// was made from go into values, if given, for the output_sinks.
+void build_header(input_buffer &buf, std::ostream &outFile, header_counts *counts = 0,
+                  bool polynomials = false, chart_values *values = 0);
+void convert_header(input_buffer &buf, std::string &text, header_counts *counts = 0,
+                    bool polynomials = false, chart_values *values = 0);
+bool write_file(const std::string &filename, const std::string &text);
+void json_string(std::string &out, std::string_view s);
+
+// A file made for a chart besides its BSB header, from the values that
+// build_header() read for the header. All sinks of a section get the same
+// values, so the section is read only once, however many files are made.
+class output_sink
+{
+public:
+    virtual ~output_sink() {}
+    virtual const char *extension() const = 0;     // of the file, like "geojson"
+    // The text of the file into text; false if the chart has not got
+    // what the file needs
+    virtual bool make(const chart_values &values, std::string &text) const = 0;
+};
+
+// GeoJSON: the PLY outline as a Polygon and every REF point as a Point
+// with its pixel x and y. An outline across the 180th meridian keeps
+// longitudes past 180, so it stays one polygon.
+class geojson_sink : public output_sink
+{
+public:
+    const char *extension() const   { return "geojson"; }
+    bool make(const chart_values &values, std::string &text) const;
+};
+
+// A world file: the affine pixel to longitude and latitude transform that
+// fits the REF points best, for the centre of the pixels
+class world_file_sink : public output_sink
+{
+public:
+    const char *extension() const   { return "wld"; }
+    bool make(const chart_values &values, std::string &text) const;
+};
+
+// A GDAL .aux.xml: the same transform as a GeoTransform, and the REF
+// points as GCPs, taken to be WGS 84
+class aux_xml_sink : public output_sink
+{
+public:
+    const char *extension() const   { return "aux.xml"; }
+    bool make(const chart_values &values, std::string &text) const;
+};
+
+// Collects the PLY outlines (B<n> fields) of charts for a coverage index,
+// which tells the charts at a place without reading their headers. An
+// outline across the 180th meridian is kept with longitudes from 0 to 360.
+class coverage_builder
+{
+private:
+    struct outline
+    {
+        std::string name;
+        size_t sequence;            // the order it was added in
+        std::vector<double> points; // lat, lon, lat, lon, ...
+    };
+    std::vector<outline> outlines;
+public:
+    bool add(std::string_view name, const input_buffer &buf);
+    size_t count() const        { return outlines.size(); }
+    bool save(const std::string &filename) const;
+};
+
+// A coverage index file mapped into memory. It has a grid of one degree
+// cells with the charts whose outline box touches each cell, so a lookup
+// only looks at the outlines of the few charts around the place.
+class coverage_index
+{
+public:
+    struct chart_entry;
+private:
+    mapped_file file;
+    const chart_entry *charts;
+    const double *points;
+    const unsigned int *cells;
+    const unsigned int *entries;
+    const char *names;
+    unsigned int n_charts;
+
+    std::string_view name(unsigned int chart) const;
+    bool contains(unsigned int chart, double lat, double lon) const;
+    bool overlaps(unsigned int chart, double south, double west, double north, double east) const;
+public:
+    coverage_index() : charts(0), points(0), cells(0), entries(0), names(0), n_charts(0) {}
+
+    bool open(const std::string &filename);
+    unsigned int count() const  { return n_charts; }
+    void find(double lat, double lon, std::vector<std::string_view> &found) const;
+    void find(double south, double west, double north, double east, std::vector<std::string_view> &found) const;
+};
+
+#endif